@@ -0,0 +1,72 @@
+#ifndef ALLOCSTATS_H
+#define ALLOCSTATS_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <ostream>
+
+/*
+ * Counts heap allocations by replacing the global operator new, so that
+ * -stats can show whether generations reuse the capacity of the previous
+ * ones. Replacement operators are defined once per program: include this
+ * only from the file with main().
+ */
+
+std::atomic<unsigned long long> heapAllocations(0);
+
+// kept out of line, or GCC pairs the malloc() and free() inside with new and delete and warns
+__attribute__((noinline)) void *operator new(std::size_t n) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = std::malloc(n ? n : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+// allocations made before the first generation, during all of them and during the last one
+class AllocationStats
+{
+private:
+
+    unsigned long long setup;
+    unsigned long long last;
+    unsigned long long lastGeneration;
+    long long nrGenerations;
+
+public:
+
+    AllocationStats() : setup(heapAllocations.load()), last(setup), lastGeneration(0), nrGenerations(0) {
+
+    }
+
+    // called once the world is loaded
+    inline void start() {
+        setup = last = heapAllocations.load();
+    }
+
+    // called after every generation
+    inline void generation() {
+        unsigned long long now = heapAllocations.load();
+        lastGeneration = now - last;
+        last = now;
+        nrGenerations++;
+    }
+
+    void report(std::ostream &out) const {
+        out << "heap allocations: " << setup << " before evolving, "
+            << last - setup << " in " << nrGenerations << " generations, "
+            << lastGeneration << " in the last one" << std::endl;
+    }
+};
+
+#endif
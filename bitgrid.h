@@ -0,0 +1,178 @@
+#ifndef BITGRID_H
+#define BITGRID_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include "cellset.h"
+#include "simd.h"
+
+#define WORD_BITS 64
+
+typedef uint64_t Word;
+
+/*
+ * Bit-sliced full adder: adds three 1-bit numbers in each of the 64
+ * lanes, giving the sum bit and the carry bit of every lane.
+ */
+inline void fullAdder(Word a, Word b, Word c, Word &sum, Word &carry) {
+    Word t = a ^ b;
+    sum = t ^ c;
+    carry = (a & b) | (t & c);
+}
+
+/*
+ * Applies the rule to 64 cells at once given the cells themselves and
+ * their six neighbor words. The neighbor count (0..6) is computed as
+ * three bit planes s2 s1 s0 with full adders, so no popcount is needed.
+ * A live cell survives with 2 to 4 neighbors, a dead one is born with
+ * 2 or 3.
+ */
+inline Word ruleWord(Word cell, Word a, Word b, Word c, Word d, Word e, Word f) {
+    Word sumA, carryA, sumB, carryB;
+    fullAdder(a, b, c, sumA, carryA);
+    fullAdder(d, e, f, sumB, carryB);
+
+    Word s0 = sumA ^ sumB;
+    Word carry0 = sumA & sumB;
+
+    Word s1, s2;
+    fullAdder(carryA, carryB, carry0, s1, s2);
+
+    Word twoOrThree = ~s2 & s1;
+    Word four = s2 & ~s1 & ~s0;
+    return twoOrThree | (cell & four);
+}
+
+/*
+ * Dense representation of the whole size^3 torus, one bit per cell.
+ * Each row holds the cells of a fixed (y, z) along x, packed into
+ * 64-cell words; rows are laid out with y varying fastest.
+ */
+class BitGrid
+{
+private:
+
+    int size;
+    int wordsPerRow;
+    Word tailMask; // valid bits of the last word of a row
+    size_t nrCells;
+    std::vector<Word> current;
+    std::vector<Word> next;
+
+    inline size_t rowOffset(int y, int z) const {
+        return ((size_t) z * size + y) * wordsPerRow;
+    }
+
+public:
+
+    BitGrid(int size) : size(size), nrCells(0) {
+        wordsPerRow = (size + WORD_BITS - 1) / WORD_BITS;
+        int tailBits = size - (wordsPerRow - 1) * WORD_BITS;
+        tailMask = tailBits == WORD_BITS ? ~0ULL : (1ULL << tailBits) - 1;
+        current.assign((size_t) size * size * wordsPerRow, 0);
+        next.assign(current.size(), 0);
+    }
+
+    inline void set(int x, int y, int z) {
+        current[rowOffset(y, z) + x / WORD_BITS] |= 1ULL << (x % WORD_BITS);
+    }
+
+    inline bool get(int x, int y, int z) const {
+        return (current[rowOffset(y, z) + x / WORD_BITS] >> (x % WORD_BITS)) & 1;
+    }
+
+    inline size_t population() const {
+        return nrCells;
+    }
+
+    void load(const CellSet &cells) {
+        std::fill(current.begin(), current.end(), 0);
+        for (auto it = cells.begin(); it != cells.end(); ++it) {
+            set(cellX(*it), cellY(*it), cellZ(*it));
+        }
+        nrCells = cells.size();
+    }
+
+    void evolve() {
+        int last = wordsPerRow - 1;
+        int lastBit = (size - 1) % WORD_BITS;
+        size_t population = 0;
+
+        for (int z = 0; z < size; z++) {
+            int zDown = z - 1 < 0 ? size - 1 : z - 1;
+            int zUp = z + 1 >= size ? 0 : z + 1;
+
+            for (int y = 0; y < size; y++) {
+                int yDown = y - 1 < 0 ? size - 1 : y - 1;
+                int yUp = y + 1 >= size ? 0 : y + 1;
+
+                const Word *row = &current[rowOffset(y, z)];
+                const Word *rowYDown = &current[rowOffset(yDown, z)];
+                const Word *rowYUp = &current[rowOffset(yUp, z)];
+                const Word *rowZDown = &current[rowOffset(y, zDown)];
+                const Word *rowZUp = &current[rowOffset(y, zUp)];
+                Word *out = &next[rowOffset(y, z)];
+
+                // bits that wrap around the torus along x
+                Word firstCell = row[0] & 1;
+                Word lastCell = (row[last] >> lastBit) & 1;
+
+                // words with both x neighbors in the row go through the vector
+                // kernel; the first word and those it leaves are done here
+                int vectorEnd = evolveWords(row, rowYDown, rowYUp, rowZDown, rowZUp, out, 1, last);
+
+                for (int w = 0; w < wordsPerRow; w = w == 0 ? vectorEnd : w + 1) {
+                    // xDown has in bit i the cell at x - 1, xUp the cell at x + 1
+                    Word xDown = (row[w] << 1) | (w > 0 ? row[w - 1] >> (WORD_BITS - 1) : lastCell);
+                    Word xUp = (row[w] >> 1) | (w < last ? row[w + 1] << (WORD_BITS - 1) : firstCell << lastBit);
+
+                    out[w] = ruleWord(row[w], xDown, xUp, rowYDown[w], rowYUp[w], rowZDown[w], rowZUp[w]);
+                }
+                out[last] &= tailMask;
+
+                population += countWords(out, wordsPerRow);
+            }
+        }
+
+        current.swap(next);
+        nrCells = population;
+    }
+
+    void store(CellSet &cells) const {
+        cells.clear();
+        cells.reserve(nrCells);
+        for (int z = 0; z < size; z++) {
+            for (int y = 0; y < size; y++) {
+                const Word *row = &current[rowOffset(y, z)];
+                for (int w = 0; w < wordsPerRow; w++) {
+                    Word bits = row[w];
+                    while (bits) {
+                        int x = w * WORD_BITS + __builtin_ctzll(bits);
+                        cells.insert(packCell(x, y, z));
+                        bits &= bits - 1;
+                    }
+                }
+            }
+        }
+    }
+
+    void cells(std::vector<CellKey> &keys) const {
+        for (int z = 0; z < size; z++) {
+            for (int y = 0; y < size; y++) {
+                const Word *row = &current[rowOffset(y, z)];
+                for (int w = 0; w < wordsPerRow; w++) {
+                    Word bits = row[w];
+                    while (bits) {
+                        int x = w * WORD_BITS + __builtin_ctzll(bits);
+                        keys.push_back(packCell(x, y, z));
+                        bits &= bits - 1;
+                    }
+                }
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,346 @@
+#ifndef BRICKS_H
+#define BRICKS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <ostream>
+#include "cellset.h"
+#include "bitgrid.h"
+
+#define BRICK_BITS 3
+#define BRICK_SIDE (1 << BRICK_BITS)
+#define BRICK_ROW0 0xffULL               // bits of the y = 0 row of a slab
+#define BRICK_COL0 0x0101010101010101ULL // bits of the z = 0 column of a slab
+#define BRICK_COL7 (BRICK_COL0 << (BRICK_SIDE - 1))
+
+/*
+ * 8x8x8 block of cells as a 512-bit mask: slab[x] holds the 8x8 cells
+ * of a fixed x, cell (y, z) in bit (y << 3) | z.
+ */
+struct Brick {
+    Word slab[BRICK_SIDE];
+};
+
+/*
+ * Block-sparse engine: the torus is tiled into bricks and only the
+ * non-empty ones are stored, in a hash map keyed by brick coordinate, so
+ * memory follows the occupied volume. Bricks are evolved with the same
+ * bit-sliced rule as the dense grid, 64 cells per word.
+ *
+ * Evolution is incremental: the next state of a brick depends only on it
+ * and its six face neighbors, so a brick none of which changed in the
+ * last generation keeps its state. Only the bricks that changed and the
+ * neighbors their changes touch are evaluated; still lifes and empty
+ * space are carried forward for free.
+ *
+ * When size is not a multiple of 8 the last brick along each axis is
+ * partial; its cells past the end of the torus are kept at zero and the
+ * shifts that cross a brick face take the last valid row of the previous
+ * brick instead of row 7.
+ */
+class BrickEngine
+{
+private:
+
+    int size;
+    int nrBricks;  // per axis
+    int lastSide;  // valid cells of the last brick along each axis
+    size_t nrCells;
+
+    std::vector<Brick> bricks;
+    std::vector<CellKey> brickKeys; // brick coordinate of each brick
+    CellCounter index;              // brick coordinate -> position in bricks
+    size_t nrEmpty;                 // bricks that died but are still stored
+
+    // bricks that changed in the last generation, as old ^ new
+    std::vector<CellKey> changedKeys;
+    std::vector<Brick> changes;
+
+    CellSet candidates;
+    std::vector<CellKey> stagedKeys; // next states that differ from the current
+    std::vector<Brick> staged;
+    Brick emptyBrick;
+
+    long long nrGenerations;
+    long long nrEvaluated;
+    long long nrLiveEvaluated;
+    long long nrLive;
+    size_t peakBricks;
+
+    inline int side(int b) const {
+        return b == nrBricks - 1 ? lastSide : BRICK_SIDE;
+    }
+
+    inline int down(int b) const {
+        return b == 0 ? nrBricks - 1 : b - 1;
+    }
+
+    inline int up(int b) const {
+        return b == nrBricks - 1 ? 0 : b + 1;
+    }
+
+    inline const Brick &brickAt(int bx, int by, int bz) const {
+        const int *i = index.find(packCell(bx, by, bz));
+        return i ? bricks[*i] : emptyBrick;
+    }
+
+    // bits of the first sy rows and sz columns of a slab
+    static inline Word slabMask(int sy, int sz) {
+        Word row = sz == BRICK_SIDE ? BRICK_ROW0 : (1ULL << sz) - 1;
+        Word mask = 0;
+        for (int y = 0; y < sy; y++) {
+            mask |= row << (y * BRICK_SIDE);
+        }
+        return mask;
+    }
+
+    static inline size_t population(const Brick &brick) {
+        size_t count = 0;
+        for (int x = 0; x < BRICK_SIDE; x++) {
+            count += __builtin_popcountll(brick.slab[x]);
+        }
+        return count;
+    }
+
+    static inline bool equal(const Brick &a, const Brick &b) {
+        for (int x = 0; x < BRICK_SIDE; x++) {
+            if (a.slab[x] != b.slab[x]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // adds a brick and the face neighbors that its (changed) cells touch
+    void addCandidates(CellKey key, const Brick &brick) {
+        int bx = cellX(key), by = cellY(key), bz = cellZ(key);
+        int sx = side(bx), sy = side(by), sz = side(bz);
+
+        Word any = 0;
+        for (int x = 0; x < sx; x++) {
+            any |= brick.slab[x];
+        }
+
+        candidates.insert(key);
+        if (brick.slab[0]) {
+            candidates.insert(packCell(down(bx), by, bz));
+        }
+        if (brick.slab[sx - 1]) {
+            candidates.insert(packCell(up(bx), by, bz));
+        }
+        if (any & BRICK_ROW0) {
+            candidates.insert(packCell(bx, down(by), bz));
+        }
+        if (any & (BRICK_ROW0 << ((sy - 1) * BRICK_SIDE))) {
+            candidates.insert(packCell(bx, up(by), bz));
+        }
+        if (any & BRICK_COL0) {
+            candidates.insert(packCell(bx, by, down(bz)));
+        }
+        if (any & (BRICK_COL0 << (sz - 1))) {
+            candidates.insert(packCell(bx, by, up(bz)));
+        }
+    }
+
+    // drops the dead bricks once they make up half of the stored ones
+    void compact() {
+        if (2 * nrEmpty <= bricks.size()) {
+            return;
+        }
+        size_t n = 0;
+        index.clear();
+        for (size_t i = 0; i < bricks.size(); i++) {
+            if (!equal(bricks[i], emptyBrick)) {
+                bricks[n] = bricks[i];
+                brickKeys[n] = brickKeys[i];
+                index[brickKeys[n]] = (int) n;
+                n++;
+            }
+        }
+        bricks.resize(n);
+        brickKeys.resize(n);
+        nrEmpty = 0;
+    }
+
+    /*
+     * Next state of brick (bx, by, bz) into out.
+     * Along x whole slabs are neighbors; along y and z the neighbor words
+     * are the slab shifted by a row or a column, with the row or column
+     * that crosses the brick face taken from the adjacent brick.
+     */
+    void evolveBrick(int bx, int by, int bz, Brick &out) const {
+        const Brick &brick = brickAt(bx, by, bz);
+        const Brick &xDown = brickAt(down(bx), by, bz);
+        const Brick &xUp = brickAt(up(bx), by, bz);
+        const Brick &yDown = brickAt(bx, down(by), bz);
+        const Brick &yUp = brickAt(bx, up(by), bz);
+        const Brick &zDown = brickAt(bx, by, down(bz));
+        const Brick &zUp = brickAt(bx, by, up(bz));
+
+        int sx = side(bx);
+        int sy = side(by);
+        int sz = side(bz);
+        int yDownLast = side(down(by)) - 1;
+        int zDownLast = side(down(bz)) - 1;
+        Word valid = slabMask(sy, sz);
+
+        for (int x = 0; x < BRICK_SIDE; x++) {
+            if (x >= sx) {
+                out.slab[x] = 0;
+                continue;
+            }
+            Word cell = brick.slab[x];
+            Word xd = x > 0 ? brick.slab[x - 1] : xDown.slab[side(down(bx)) - 1];
+            Word xu = x < sx - 1 ? brick.slab[x + 1] : xUp.slab[0];
+            Word yd = (cell << BRICK_SIDE) | ((yDown.slab[x] >> (yDownLast * BRICK_SIDE)) & BRICK_ROW0);
+            Word yu = (cell >> BRICK_SIDE) | ((yUp.slab[x] & BRICK_ROW0) << ((sy - 1) * BRICK_SIDE));
+            Word zd = ((cell << 1) & ~BRICK_COL0) | ((zDown.slab[x] >> zDownLast) & BRICK_COL0);
+            Word zu = ((cell >> 1) & ~BRICK_COL7) | ((zUp.slab[x] & BRICK_COL0) << (sz - 1));
+
+            out.slab[x] = ruleWord(cell, xd, xu, yd, yu, zd, zu) & valid;
+        }
+    }
+
+public:
+
+    BrickEngine(int size) : size(size), nrCells(0), nrEmpty(0), nrGenerations(0), nrEvaluated(0),
+                            nrLiveEvaluated(0), nrLive(0), peakBricks(0) {
+        nrBricks = (size + BRICK_SIDE - 1) / BRICK_SIDE;
+        lastSide = size - (nrBricks - 1) * BRICK_SIDE;
+        for (int x = 0; x < BRICK_SIDE; x++) {
+            emptyBrick.slab[x] = 0;
+        }
+    }
+
+    inline size_t population() const {
+        return nrCells;
+    }
+
+    void load(const std::vector<CellKey> &cells) {
+        bricks.clear();
+        brickKeys.clear();
+        index.clear();
+        for (auto it = cells.begin(); it != cells.end(); ++it) {
+            int x = cellX(*it), y = cellY(*it), z = cellZ(*it);
+            CellKey key = packCell(x >> BRICK_BITS, y >> BRICK_BITS, z >> BRICK_BITS);
+            const int *i = index.find(key);
+            if (!i) {
+                index[key] = (int) bricks.size();
+                bricks.push_back(emptyBrick);
+                brickKeys.push_back(key);
+                i = index.find(key);
+            }
+            int local = ((y & (BRICK_SIDE - 1)) << BRICK_BITS) | (z & (BRICK_SIDE - 1));
+            bricks[*i].slab[x & (BRICK_SIDE - 1)] |= 1ULL << local;
+        }
+        nrCells = cells.size();
+        nrEmpty = 0;
+        peakBricks = bricks.size();
+
+        // everything loaded counts as changed for the first generation
+        changedKeys = brickKeys;
+        changes = bricks;
+    }
+
+    /*
+     * Next states are computed for all candidates before any is stored,
+     * since candidates read their neighbors' current states. A dead brick
+     * can only come alive through a face with live cells on the other
+     * side, which addCandidates checks on the changed cells.
+     */
+    void evolve() {
+        candidates.clear();
+        for (size_t i = 0; i < changedKeys.size(); i++) {
+            addCandidates(changedKeys[i], changes[i]);
+        }
+
+        stagedKeys.clear();
+        staged.clear();
+        Brick out;
+
+        for (auto it = candidates.begin(); it != candidates.end(); ++it) {
+            const Brick &brick = brickAt(cellX(*it), cellY(*it), cellZ(*it));
+            if (!equal(brick, emptyBrick)) {
+                nrLiveEvaluated++;
+            }
+            evolveBrick(cellX(*it), cellY(*it), cellZ(*it), out);
+            if (!equal(out, brick)) {
+                stagedKeys.push_back(*it);
+                staged.push_back(out);
+            }
+        }
+
+        nrGenerations++;
+        nrEvaluated += candidates.size();
+        nrLive += bricks.size() - nrEmpty;
+
+        changedKeys.clear();
+        changes.clear();
+
+        for (size_t s = 0; s < staged.size(); s++) {
+            const int *found = index.find(stagedKeys[s]);
+            int i;
+            if (found) {
+                i = *found;
+            }
+            else {
+                i = (int) bricks.size();
+                index[stagedKeys[s]] = i;
+                bricks.push_back(emptyBrick);
+                brickKeys.push_back(stagedKeys[s]);
+                nrEmpty++;
+            }
+
+            size_t before = population(bricks[i]);
+            size_t after = population(staged[s]);
+            if (before == 0) {
+                nrEmpty--;
+            }
+            if (after == 0) {
+                nrEmpty++;
+            }
+            nrCells = nrCells - before + after;
+
+            Brick diff;
+            for (int x = 0; x < BRICK_SIDE; x++) {
+                diff.slab[x] = bricks[i].slab[x] ^ staged[s].slab[x];
+            }
+            bricks[i] = staged[s];
+            changedKeys.push_back(stagedKeys[s]);
+            changes.push_back(diff);
+        }
+
+        peakBricks = std::max(peakBricks, bricks.size() - nrEmpty);
+        compact();
+    }
+
+    void cells(std::vector<CellKey> &keys) const {
+        keys.reserve(keys.size() + nrCells);
+        for (size_t i = 0; i < bricks.size(); i++) {
+            int x0 = cellX(brickKeys[i]) << BRICK_BITS;
+            int y0 = cellY(brickKeys[i]) << BRICK_BITS;
+            int z0 = cellZ(brickKeys[i]) << BRICK_BITS;
+            for (int x = 0; x < BRICK_SIDE; x++) {
+                Word bits = bricks[i].slab[x];
+                while (bits) {
+                    int bit = __builtin_ctzll(bits);
+                    keys.push_back(packCell(x0 + x, y0 + (bit >> BRICK_BITS), z0 + (bit & (BRICK_SIDE - 1))));
+                    bits &= bits - 1;
+                }
+            }
+        }
+    }
+
+    void report(std::ostream &os) const {
+        double world = (double) nrBricks * nrBricks * nrBricks;
+        double generations = nrGenerations > 0 ? (double) nrGenerations : 1.0;
+        os << "bricks: " << bricks.size() - nrEmpty << " live of " << (size_t) world
+           << ", peak " << peakBricks << " (" << peakBricks * sizeof(Brick) / 1024 << " KB), "
+           << (long long) (nrEvaluated / generations) << " evaluated per generation" << std::endl;
+        os << "bricks: skipped " << 100.0 * (1.0 - nrEvaluated / (generations * world)) << "% of the world, "
+           << 100.0 * (nrLive > 0 ? 1.0 - (double) nrLiveEvaluated / nrLive : 0.0) << "% of live bricks" << std::endl;
+    }
+};
+
+#endif
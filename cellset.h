@@ -0,0 +1,375 @@
+#ifndef CELLSET_H
+#define CELLSET_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+
+/*
+ * Cells are packed into a single 64-bit key with 21 bits per coordinate,
+ * x in the most significant field, so sorting keys gives the same
+ * (x, y, z) order printResults needs.
+ */
+
+#define KEY_BITS 21
+#define KEY_MASK ((1ULL << KEY_BITS) - 1)
+#define EMPTY_KEY (~0ULL)
+#define MIN_CAPACITY 16
+
+// added by the scatter kernel to a cell's own count, above any neighbor count
+#define LIVE_MARK 8
+
+typedef uint64_t CellKey;
+
+inline CellKey packCell(int x, int y, int z) {
+    return ((CellKey) x << (2 * KEY_BITS)) |
+           ((CellKey) y << KEY_BITS) |
+           (CellKey) z;
+}
+
+inline int cellX(CellKey key) {
+    return (int) ((key >> (2 * KEY_BITS)) & KEY_MASK);
+}
+
+inline int cellY(CellKey key) {
+    return (int) ((key >> KEY_BITS) & KEY_MASK);
+}
+
+inline int cellZ(CellKey key) {
+    return (int) (key & KEY_MASK);
+}
+
+// murmur3 finalizer: every input bit affects every output bit
+inline uint64_t mixKey(CellKey key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+inline size_t tableCapacity(size_t n) {
+    size_t capacity = MIN_CAPACITY;
+    while (capacity < 2 * n) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+/*
+ * Flat open-addressing set of cell keys with linear probing.
+ * Kept at most half full, so misses (the common case when probing
+ * neighbors) end after a couple of slots.
+ */
+class CellSet
+{
+private:
+
+    std::vector<CellKey> slots;
+    size_t mask;
+    size_t nrKeys;
+
+    void rehash(size_t capacity) {
+        std::vector<CellKey> old(capacity, EMPTY_KEY);
+        old.swap(slots);
+        mask = capacity - 1;
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i] != EMPTY_KEY) {
+                size_t pos = mixKey(old[i]) & mask;
+                while (slots[pos] != EMPTY_KEY) {
+                    pos = (pos + 1) & mask;
+                }
+                slots[pos] = old[i];
+            }
+        }
+    }
+
+public:
+
+    class iterator
+    {
+    private:
+
+        const CellKey *slot;
+        const CellKey *last;
+
+        void skipEmpty() {
+            while (slot != last && *slot == EMPTY_KEY) {
+                slot++;
+            }
+        }
+
+    public:
+
+        typedef std::forward_iterator_tag iterator_category;
+        typedef CellKey value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const CellKey *pointer;
+        typedef CellKey reference;
+
+        iterator(const CellKey *slot, const CellKey *last) : slot(slot), last(last) {
+            skipEmpty();
+        }
+
+        inline CellKey operator*() const {
+            return *slot;
+        }
+
+        inline iterator &operator++() {
+            slot++;
+            skipEmpty();
+            return *this;
+        }
+
+        inline bool operator!=(const iterator &it) const {
+            return slot != it.slot;
+        }
+
+        inline bool operator==(const iterator &it) const {
+            return slot == it.slot;
+        }
+    };
+
+    CellSet() : slots(MIN_CAPACITY, EMPTY_KEY), mask(MIN_CAPACITY - 1), nrKeys(0) {
+
+    }
+
+    inline bool insert(CellKey key) {
+        if (2 * (nrKeys + 1) > slots.size()) {
+            rehash(slots.size() * 2);
+        }
+        size_t pos = mixKey(key) & mask;
+        while (slots[pos] != EMPTY_KEY) {
+            if (slots[pos] == key) {
+                return false;
+            }
+            pos = (pos + 1) & mask;
+        }
+        slots[pos] = key;
+        nrKeys++;
+        return true;
+    }
+
+    inline bool contains(CellKey key) const {
+        size_t pos = mixKey(key) & mask;
+        while (slots[pos] != EMPTY_KEY) {
+            if (slots[pos] == key) {
+                return true;
+            }
+            pos = (pos + 1) & mask;
+        }
+        return false;
+    }
+
+    inline void reserve(size_t n) {
+        size_t capacity = tableCapacity(n);
+        if (capacity > slots.size()) {
+            rehash(capacity);
+        }
+    }
+
+    inline void clear() {
+        std::fill(slots.begin(), slots.end(), EMPTY_KEY);
+        nrKeys = 0;
+    }
+
+    inline size_t size() const {
+        return nrKeys;
+    }
+
+    inline size_t capacity() const {
+        return slots.size();
+    }
+
+    // all capacity() slots, empty ones with EMPTY_KEY
+    inline const CellKey *data() const {
+        return slots.data();
+    }
+
+    inline iterator begin() const {
+        return iterator(slots.data(), slots.data() + slots.size());
+    }
+
+    inline iterator end() const {
+        const CellKey *last = slots.data() + slots.size();
+        return iterator(last, last);
+    }
+};
+
+/*
+ * Flat open-addressing map from cell key to a neighbor count, used for
+ * the dead cells that border live ones.
+ */
+class CellCounter
+{
+public:
+
+    struct Entry {
+        CellKey key;
+        int count;
+    };
+
+private:
+
+    std::vector<Entry> slots;
+    size_t mask;
+    size_t nrKeys;
+
+    static Entry emptyEntry() {
+        Entry entry = { EMPTY_KEY, 0 };
+        return entry;
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Entry> old(capacity, emptyEntry());
+        old.swap(slots);
+        mask = capacity - 1;
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i].key != EMPTY_KEY) {
+                size_t pos = mixKey(old[i].key) & mask;
+                while (slots[pos].key != EMPTY_KEY) {
+                    pos = (pos + 1) & mask;
+                }
+                slots[pos] = old[i];
+            }
+        }
+    }
+
+public:
+
+    class iterator
+    {
+    private:
+
+        Entry *slot;
+        Entry *last;
+
+        void skipEmpty() {
+            while (slot != last && slot->key == EMPTY_KEY) {
+                slot++;
+            }
+        }
+
+    public:
+
+        iterator(Entry *slot, Entry *last) : slot(slot), last(last) {
+            skipEmpty();
+        }
+
+        inline Entry &operator*() const {
+            return *slot;
+        }
+
+        inline Entry *operator->() const {
+            return slot;
+        }
+
+        inline iterator &operator++() {
+            slot++;
+            skipEmpty();
+            return *this;
+        }
+
+        inline bool operator!=(const iterator &it) const {
+            return slot != it.slot;
+        }
+
+        inline bool operator==(const iterator &it) const {
+            return slot == it.slot;
+        }
+    };
+
+    CellCounter() : slots(MIN_CAPACITY, emptyEntry()), mask(MIN_CAPACITY - 1), nrKeys(0) {
+
+    }
+
+    // returns the count for key, inserting it with count 0 if absent
+    inline int &operator[](CellKey key) {
+        return at(key, mixKey(key));
+    }
+
+    // operator[] with mixKey(key) already computed
+    inline int &at(CellKey key, uint64_t hash) {
+        if (2 * (nrKeys + 1) > slots.size()) {
+            rehash(slots.size() * 2);
+        }
+        size_t pos = hash & mask;
+        while (slots[pos].key != EMPTY_KEY) {
+            if (slots[pos].key == key) {
+                return slots[pos].count;
+            }
+            pos = (pos + 1) & mask;
+        }
+        slots[pos].key = key;
+        nrKeys++;
+        return slots[pos].count;
+    }
+
+    // adds amount to the count of key, as SharedCounter::increment does
+    inline void increment(CellKey key, int amount) {
+        (*this)[key] += amount;
+    }
+
+    // returns the count for key, or null if key is absent
+    inline const int *find(CellKey key) const {
+        size_t pos = mixKey(key) & mask;
+        while (slots[pos].key != EMPTY_KEY) {
+            if (slots[pos].key == key) {
+                return &slots[pos].count;
+            }
+            pos = (pos + 1) & mask;
+        }
+        return nullptr;
+    }
+
+    inline void reserve(size_t n) {
+        size_t capacity = tableCapacity(n);
+        if (capacity > slots.size()) {
+            rehash(capacity);
+        }
+    }
+
+    inline void clear() {
+        std::fill(slots.begin(), slots.end(), emptyEntry());
+        nrKeys = 0;
+    }
+
+    inline size_t size() const {
+        return nrKeys;
+    }
+
+    inline size_t capacity() const {
+        return slots.size();
+    }
+
+    // all capacity() slots, empty ones with EMPTY_KEY and count 0
+    inline const Entry *data() const {
+        return slots.data();
+    }
+
+    inline iterator begin() {
+        return iterator(slots.data(), slots.data() + slots.size());
+    }
+
+    inline iterator end() {
+        Entry *last = slots.data() + slots.size();
+        return iterator(last, last);
+    }
+};
+
+/* Aux functions for printing data */
+
+inline void printCells(std::vector<CellKey> &keys) {
+    std::sort(keys.begin(), keys.end());
+
+    for (auto it = keys.begin(); it != keys.end(); ++it) {
+        std::cout << cellX(*it) << " " << cellY(*it) << " " << cellZ(*it) << "\n";
+    }
+    std::cout.flush();
+}
+
+#endif
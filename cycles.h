@@ -0,0 +1,79 @@
+#ifndef CYCLES_H
+#define CYCLES_H
+
+#include <cstdint>
+#include <cstddef>
+#include "cellset.h"
+
+#define CYCLE_HISTORY 64
+#define FINGERPRINT_SALT 0x9e3779b97f4a7c15ULL
+
+/*
+ * Order-independent fingerprint of a generation: two sums of differently
+ * mixed cell keys plus the population. Sums commute, so cells can be
+ * added in any order, by any thread or process, as they are inserted
+ * into the next generation.
+ */
+struct Fingerprint {
+    uint64_t sum;
+    uint64_t sum2;
+    uint64_t population;
+
+    Fingerprint() : sum(0), sum2(0), population(0) {
+
+    }
+
+    inline void add(CellKey key) {
+        uint64_t h = mixKey(key);
+        sum += h;
+        sum2 += mixKey(h ^ FINGERPRINT_SALT);
+        population++;
+    }
+
+    inline void add(const Fingerprint &fingerprint) {
+        sum += fingerprint.sum;
+        sum2 += fingerprint.sum2;
+        population += fingerprint.population;
+    }
+
+    inline bool operator==(const Fingerprint &fingerprint) const {
+        return sum == fingerprint.sum &&
+               sum2 == fingerprint.sum2 &&
+               population == fingerprint.population;
+    }
+};
+
+/*
+ * Ring of the fingerprints of the last CYCLE_HISTORY generations. A
+ * generation equal to one p generations back means the world repeats
+ * with period p (1 for still lifes and for extinction).
+ */
+class CycleDetector
+{
+private:
+
+    Fingerprint history[CYCLE_HISTORY];
+    long long nrRecorded;
+
+public:
+
+    CycleDetector() : nrRecorded(0) {
+
+    }
+
+    // records the next generation, returning its period or 0
+    int record(const Fingerprint &fingerprint) {
+        int period = 0;
+        for (int p = 1; p <= CYCLE_HISTORY && p <= nrRecorded; p++) {
+            if (history[(nrRecorded - p) % CYCLE_HISTORY] == fingerprint) {
+                period = p;
+                break;
+            }
+        }
+        history[nrRecorded % CYCLE_HISTORY] = fingerprint;
+        nrRecorded++;
+        return period;
+    }
+};
+
+#endif
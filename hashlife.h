@@ -0,0 +1,602 @@
+#ifndef HASHLIFE_H
+#define HASHLIFE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <iostream>
+#include "cellset.h"
+
+#define LEAF_LEVEL 2
+#define MAX_LEVEL 22
+#define NO_NODE 0xffffffffu
+#define BLOCK_BITS 19
+
+/*
+ * Hashlife for the 3D rule: the world is an octree whose nodes are
+ * canonicalized (equal subtrees are the same node), and the result of
+ * advancing a node is memoized, so regular patterns are evolved once and
+ * then reused across space and time.
+ *
+ * A node of level L is a 2^L cube; leaves are level 2, a 4x4x4 cube held
+ * in one 64-bit word. result(node, j) is the center 2^(L-1) cube of a
+ * level L node advanced 2^j generations (j <= L - 2), computed from 27
+ * overlapping subcubes as in the 2D algorithm.
+ *
+ * The torus is handled by tiling: when size is a power of two, a node made
+ * of copies of the world has the next world as its result, so the whole
+ * run stays in the tree and steps can be as long as the run. Other
+ * sizes rebuild, every step, the part of the infinite tiling inside the
+ * light cone of the world and cut the world back out of the result.
+ *
+ * Nodes and results live until the memory budget is exceeded; then, at
+ * the end of a step, everything but the current world is dropped.
+ */
+class Hashlife
+{
+private:
+
+    struct Node {
+        uint32_t child[8]; // octant (x << 2) | (y << 1) | z, unused in leaves
+        uint64_t bits;     // leaf cells, bit (x << 4) | (y << 2) | z
+        uint32_t level;
+        uint32_t hash;
+    };
+
+    struct Result {
+        uint64_t key; // (node << 6) | j
+        uint32_t node;
+    };
+
+    int size;
+    int worldLevel;   // level of the world when size is a power of two, else -1
+    int tileLevel;
+    size_t budget;    // bytes
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> table; // node ids, open addressing
+    std::vector<Result> results; // open addressing
+    size_t nrResults;
+    uint32_t empty[MAX_LEVEL + 1];
+
+    uint32_t world;                // power of two sizes
+    std::vector<CellKey> worldCells; // other sizes
+
+    // statistics
+    long long nrSteps;
+    long long nrHits;
+    long long nrMisses;
+    int nrCollections;
+    size_t peakMemory;
+
+    static inline int octant(int x, int y, int z) {
+        return (x << 2) | (y << 1) | z;
+    }
+
+    static inline int leafBit(int x, int y, int z) {
+        return (x << 4) | (y << 2) | z;
+    }
+
+    static inline uint32_t hashNode(const Node &node) {
+        uint64_t h = mixKey(node.bits ^ ((uint64_t) node.level << 58));
+        for (int i = 0; i < 8; i++) {
+            h = mixKey(h ^ node.child[i]);
+        }
+        return (uint32_t) h;
+    }
+
+    static inline bool sameNode(const Node &a, const Node &b) {
+        if (a.level != b.level || a.bits != b.bits) {
+            return false;
+        }
+        for (int i = 0; i < 8; i++) {
+            if (a.child[i] != b.child[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void growTable() {
+        std::vector<uint32_t> old(table.size() * 2, NO_NODE);
+        old.swap(table);
+        size_t mask = table.size() - 1;
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i] != NO_NODE) {
+                size_t pos = nodes[old[i]].hash & mask;
+                while (table[pos] != NO_NODE) {
+                    pos = (pos + 1) & mask;
+                }
+                table[pos] = old[i];
+            }
+        }
+    }
+
+    // returns the canonical node equal to node, adding it if it is new
+    uint32_t intern(Node &node) {
+        if (2 * (nodes.size() + 1) > table.size()) {
+            growTable();
+        }
+        node.hash = hashNode(node);
+        size_t mask = table.size() - 1;
+        size_t pos = node.hash & mask;
+        while (table[pos] != NO_NODE) {
+            if (sameNode(nodes[table[pos]], node)) {
+                return table[pos];
+            }
+            pos = (pos + 1) & mask;
+        }
+        table[pos] = (uint32_t) nodes.size();
+        nodes.push_back(node);
+        return table[pos];
+    }
+
+    uint32_t leaf(uint64_t bits) {
+        Node node;
+        std::fill(node.child, node.child + 8, NO_NODE);
+        node.bits = bits;
+        node.level = LEAF_LEVEL;
+        return intern(node);
+    }
+
+    uint32_t join(uint32_t level, const uint32_t child[8]) {
+        Node node;
+        std::copy(child, child + 8, node.child);
+        node.bits = 0;
+        node.level = level;
+        return intern(node);
+    }
+
+    void growResults() {
+        Result none = { EMPTY_KEY, NO_NODE };
+        std::vector<Result> old(results.size() * 2, none);
+        old.swap(results);
+        size_t mask = results.size() - 1;
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i].key != EMPTY_KEY) {
+                size_t pos = mixKey(old[i].key) & mask;
+                while (results[pos].key != EMPTY_KEY) {
+                    pos = (pos + 1) & mask;
+                }
+                results[pos] = old[i];
+            }
+        }
+    }
+
+    uint32_t findResult(uint64_t key) const {
+        size_t mask = results.size() - 1;
+        size_t pos = mixKey(key) & mask;
+        while (results[pos].key != EMPTY_KEY) {
+            if (results[pos].key == key) {
+                return results[pos].node;
+            }
+            pos = (pos + 1) & mask;
+        }
+        return NO_NODE;
+    }
+
+    void storeResult(uint64_t key, uint32_t node) {
+        if (2 * (nrResults + 1) > results.size()) {
+            growResults();
+        }
+        size_t mask = results.size() - 1;
+        size_t pos = mixKey(key) & mask;
+        while (results[pos].key != EMPTY_KEY) {
+            pos = (pos + 1) & mask;
+        }
+        results[pos].key = key;
+        results[pos].node = node;
+        nrResults++;
+    }
+
+    void reset() {
+        nodes.clear();
+        table.assign(1 << 16, NO_NODE);
+        Result none = { EMPTY_KEY, NO_NODE };
+        results.assign(1 << 16, none);
+        nrResults = 0;
+
+        empty[LEAF_LEVEL] = leaf(0);
+        for (int level = LEAF_LEVEL + 1; level <= MAX_LEVEL; level++) {
+            uint32_t child[8];
+            std::fill(child, child + 8, empty[level - 1]);
+            empty[level] = join(level, child);
+        }
+    }
+
+    // cell (x, y, z) of a level 3 node, coordinates in [0, 8)
+    inline bool cellOf(const Node &node, int x, int y, int z) const {
+        const Node &child = nodes[node.child[octant(x >> 2, y >> 2, z >> 2)]];
+        return (child.bits >> leafBit(x & 3, y & 3, z & 3)) & 1;
+    }
+
+    /*
+     * Base case: a level 3 node (8x8x8) advanced 1 or 2 generations by
+     * brute force. Each generation the valid region shrinks by one cell
+     * on every side, leaving at least the center 4x4x4.
+     */
+    uint32_t baseResult(const Node &node, int generations) {
+        bool cells[8][8][8];
+        bool next[8][8][8];
+        for (int x = 0; x < 8; x++) {
+            for (int y = 0; y < 8; y++) {
+                for (int z = 0; z < 8; z++) {
+                    cells[x][y][z] = cellOf(node, x, y, z);
+                }
+            }
+        }
+
+        for (int g = 1; g <= generations; g++) {
+            for (int x = g; x < 8 - g; x++) {
+                for (int y = g; y < 8 - g; y++) {
+                    for (int z = g; z < 8 - g; z++) {
+                        int neighbors = cells[x - 1][y][z] + cells[x + 1][y][z] +
+                                        cells[x][y - 1][z] + cells[x][y + 1][z] +
+                                        cells[x][y][z - 1] + cells[x][y][z + 1];
+                        next[x][y][z] = cells[x][y][z] ? neighbors >= 2 && neighbors <= 4
+                                                       : neighbors == 2 || neighbors == 3;
+                    }
+                }
+            }
+            for (int x = g; x < 8 - g; x++) {
+                for (int y = g; y < 8 - g; y++) {
+                    for (int z = g; z < 8 - g; z++) {
+                        cells[x][y][z] = next[x][y][z];
+                    }
+                }
+            }
+        }
+
+        uint64_t bits = 0;
+        for (int x = 0; x < 4; x++) {
+            for (int y = 0; y < 4; y++) {
+                for (int z = 0; z < 4; z++) {
+                    if (cells[x + 2][y + 2][z + 2]) {
+                        bits |= 1ULL << leafBit(x, y, z);
+                    }
+                }
+            }
+        }
+        return leaf(bits);
+    }
+
+    // center 2^(L-1) cube of a level L node, not advanced
+    uint32_t center(uint32_t id) {
+        Node node = nodes[id];
+        if (node.level == LEAF_LEVEL + 1) {
+            uint64_t bits = 0;
+            for (int x = 0; x < 4; x++) {
+                for (int y = 0; y < 4; y++) {
+                    for (int z = 0; z < 4; z++) {
+                        if (cellOf(node, x + 2, y + 2, z + 2)) {
+                            bits |= 1ULL << leafBit(x, y, z);
+                        }
+                    }
+                }
+            }
+            return leaf(bits);
+        }
+
+        uint32_t child[8];
+        for (int i = 0; i < 8; i++) {
+            child[i] = nodes[node.child[i]].child[i ^ 7];
+        }
+        return join(node.level - 1, child);
+    }
+
+    // center 2^(L-1) cube of a level L node advanced 2^j generations
+    uint32_t result(uint32_t id, int j) {
+        Node node = nodes[id];
+        int level = node.level;
+        if (id == empty[level]) {
+            return empty[level - 1];
+        }
+
+        uint64_t key = ((uint64_t) id << 6) | j;
+        uint32_t cached = findResult(key);
+        if (cached != NO_NODE) {
+            nrHits++;
+            return cached;
+        }
+        nrMisses++;
+
+        uint32_t r;
+        if (level == LEAF_LEVEL + 1) {
+            r = baseResult(node, 1 << j);
+        }
+        else {
+            // 4x4x4 grid of grandchildren
+            uint32_t grid[4][4][4];
+            for (int x = 0; x < 4; x++) {
+                for (int y = 0; y < 4; y++) {
+                    for (int z = 0; z < 4; z++) {
+                        uint32_t child = node.child[octant(x >> 1, y >> 1, z >> 1)];
+                        grid[x][y][z] = nodes[child].child[octant(x & 1, y & 1, z & 1)];
+                    }
+                }
+            }
+
+            // 27 overlapping subcubes, advanced half the way on a full step
+            uint32_t middle[3][3][3];
+            for (int x = 0; x < 3; x++) {
+                for (int y = 0; y < 3; y++) {
+                    for (int z = 0; z < 3; z++) {
+                        uint32_t child[8];
+                        for (int i = 0; i < 8; i++) {
+                            child[i] = grid[x + (i >> 2)][y + ((i >> 1) & 1)][z + (i & 1)];
+                        }
+                        uint32_t sub = join(level - 1, child);
+                        middle[x][y][z] = j == level - 2 ? result(sub, level - 3) : center(sub);
+                    }
+                }
+            }
+
+            // 8 subcubes of those, advanced the rest of the way
+            uint32_t out[8];
+            for (int o = 0; o < 8; o++) {
+                int x = o >> 2;
+                int y = (o >> 1) & 1;
+                int z = o & 1;
+                uint32_t child[8];
+                for (int i = 0; i < 8; i++) {
+                    child[i] = middle[x + (i >> 2)][y + ((i >> 1) & 1)][z + (i & 1)];
+                }
+                out[o] = result(join(level - 1, child), std::min(j, level - 3));
+            }
+            r = join(level - 1, out);
+        }
+
+        storeResult(key, r);
+        return r;
+    }
+
+    static inline uint64_t blockKey(uint64_t x, uint64_t y, uint64_t z) {
+        return (x << (2 * BLOCK_BITS)) | (y << BLOCK_BITS) | z;
+    }
+
+    // level node holding cells, given as CellKeys in [0, 2^level)
+    uint32_t build(const std::vector<CellKey> &cells, int level) {
+        const uint64_t blockMask = (1ULL << BLOCK_BITS) - 1;
+
+        std::vector<uint64_t> bits;
+        bits.reserve(cells.size());
+        for (size_t i = 0; i < cells.size(); i++) {
+            int x = cellX(cells[i]);
+            int y = cellY(cells[i]);
+            int z = cellZ(cells[i]);
+            bits.push_back((blockKey(x >> 2, y >> 2, z >> 2) << 6) | leafBit(x & 3, y & 3, z & 3));
+        }
+        std::sort(bits.begin(), bits.end());
+
+        // (block key, node) of the nonempty blocks of the current level
+        std::vector<std::pair<uint64_t, uint32_t> > blocks;
+        for (size_t i = 0; i < bits.size(); ) {
+            uint64_t block = bits[i] >> 6;
+            uint64_t leafBits = 0;
+            for (; i < bits.size() && bits[i] >> 6 == block; i++) {
+                leafBits |= 1ULL << (bits[i] & 63);
+            }
+            blocks.push_back(std::make_pair(block, leaf(leafBits)));
+        }
+
+        for (int l = LEAF_LEVEL + 1; l <= level; l++) {
+            // parent block key with the octant in the low 3 bits
+            std::vector<std::pair<uint64_t, uint32_t> > children;
+            children.reserve(blocks.size());
+            for (size_t i = 0; i < blocks.size(); i++) {
+                uint64_t x = blocks[i].first >> (2 * BLOCK_BITS);
+                uint64_t y = (blocks[i].first >> BLOCK_BITS) & blockMask;
+                uint64_t z = blocks[i].first & blockMask;
+                uint64_t parent = blockKey(x >> 1, y >> 1, z >> 1);
+                children.push_back(std::make_pair((parent << 3) | octant(x & 1, y & 1, z & 1), blocks[i].second));
+            }
+            std::sort(children.begin(), children.end());
+
+            blocks.clear();
+            for (size_t i = 0; i < children.size(); ) {
+                uint64_t parent = children[i].first >> 3;
+                uint32_t child[8];
+                std::fill(child, child + 8, empty[l - 1]);
+                for (; i < children.size() && children[i].first >> 3 == parent; i++) {
+                    child[children[i].first & 7] = children[i].second;
+                }
+                blocks.push_back(std::make_pair(parent, join(l, child)));
+            }
+        }
+
+        return blocks.empty() ? empty[level] : blocks[0].second;
+    }
+
+    // appends the cells of a node at (ox, oy, oz) that lie inside the world
+    void extract(uint32_t id, int ox, int oy, int oz, std::vector<CellKey> &cells) const {
+        const Node &node = nodes[id];
+        if (id == empty[node.level] || ox >= size || oy >= size || oz >= size) {
+            return;
+        }
+        if (node.level == LEAF_LEVEL) {
+            uint64_t bits = node.bits;
+            while (bits) {
+                int bit = __builtin_ctzll(bits);
+                int x = ox + (bit >> 4);
+                int y = oy + ((bit >> 2) & 3);
+                int z = oz + (bit & 3);
+                if (x < size && y < size && z < size) {
+                    cells.push_back(packCell(x, y, z));
+                }
+                bits &= bits - 1;
+            }
+            return;
+        }
+        int half = 1 << (node.level - 1);
+        for (int i = 0; i < 8; i++) {
+            extract(node.child[i], ox + (i >> 2) * half, oy + ((i >> 1) & 1) * half, oz + (i & 1) * half, cells);
+        }
+    }
+
+    /*
+     * The next world 2^j generations ahead, from a tile of copies of the
+     * world big enough for the step. With 2x2x2 copies the world is
+     * shifted by half a period so that the result lines up with it; with
+     * more copies the result is itself a tiling and any aligned
+     * period-sized cube of it is the world.
+     */
+    uint32_t stepWorld(int j) {
+        int level = std::max(worldLevel + 1, j + 2);
+
+        if (level == worldLevel + 1) {
+            uint32_t shifted[8];
+            for (int i = 0; i < 8; i++) {
+                shifted[i] = nodes[world].child[i ^ 7];
+            }
+            uint32_t tile[8];
+            std::fill(tile, tile + 8, join(worldLevel, shifted));
+            return result(join(level, tile), j);
+        }
+
+        uint32_t tile = world;
+        for (int l = worldLevel + 1; l <= level; l++) {
+            uint32_t copies[8];
+            std::fill(copies, copies + 8, tile);
+            tile = join(l, copies);
+        }
+
+        uint32_t next = result(tile, j);
+        while (nodes[next].level > (uint32_t) worldLevel) {
+            next = nodes[next].child[0];
+        }
+        return next;
+    }
+
+    /*
+     * The copies of the world inside the light cone of a 2^j generation
+     * step, placed so that the result of the tile starts at the world
+     * origin.
+     */
+    uint32_t lightConeTile(int j) {
+        int quarter = 1 << (tileLevel - 2);
+        int reach = 1 << j;
+        int low = quarter - reach;
+        int high = quarter + size + reach;
+
+        std::vector<CellKey> copies;
+        for (size_t i = 0; i < worldCells.size(); i++) {
+            int x = cellX(worldCells[i]);
+            int y = cellY(worldCells[i]);
+            int z = cellZ(worldCells[i]);
+            for (int cx = x + quarter - size * 2; cx < high; cx += size) {
+                if (cx < low) {
+                    continue;
+                }
+                for (int cy = y + quarter - size * 2; cy < high; cy += size) {
+                    if (cy < low) {
+                        continue;
+                    }
+                    for (int cz = z + quarter - size * 2; cz < high; cz += size) {
+                        if (cz >= low) {
+                            copies.push_back(packCell(cx, cy, cz));
+                        }
+                    }
+                }
+            }
+        }
+        return build(copies, tileLevel);
+    }
+
+    void collect() {
+        if (worldLevel >= 0) {
+            std::vector<CellKey> cells;
+            extract(world, 0, 0, 0, cells);
+            reset();
+            world = build(cells, worldLevel);
+        }
+        else {
+            reset();
+        }
+        nrCollections++;
+    }
+
+public:
+
+    Hashlife(int size, size_t budget) : size(size), worldLevel(-1), budget(budget), nrResults(0),
+        world(NO_NODE), nrSteps(0), nrHits(0), nrMisses(0), nrCollections(0), peakMemory(0) {
+
+        int level = 0;
+        while ((1 << level) < size) {
+            level++;
+        }
+        if ((1 << level) == size && level > LEAF_LEVEL) {
+            worldLevel = level;
+            tileLevel = level + 1;
+        }
+        else {
+            // smallest tile whose result holds a whole period
+            tileLevel = std::max(level + 1, LEAF_LEVEL + 1);
+        }
+        reset();
+    }
+
+    inline size_t memoryUsage() const {
+        return nodes.capacity() * sizeof(Node) + table.capacity() * sizeof(uint32_t) +
+               results.capacity() * sizeof(Result);
+    }
+
+    void load(const std::vector<CellKey> &cells) {
+        if (worldLevel >= 0) {
+            world = build(cells, worldLevel);
+        }
+        else {
+            worldCells = cells;
+        }
+    }
+
+    /*
+     * Advances the world by any number of generations, in the largest
+     * power-of-two steps the tile allows.
+     */
+    void advance(long long generations) {
+        int maxStep = worldLevel >= 0 ? MAX_LEVEL - 2 : tileLevel - 2;
+        while (generations > 0) {
+            int j = 0;
+            while (j < maxStep && (2LL << j) <= generations) {
+                j++;
+            }
+
+            if (worldLevel >= 0) {
+                world = stepWorld(j);
+            }
+            else {
+                uint32_t next = result(lightConeTile(j), j);
+                worldCells.clear();
+                extract(next, 0, 0, 0, worldCells);
+            }
+            generations -= 1LL << j;
+            nrSteps++;
+
+            peakMemory = std::max(peakMemory, memoryUsage());
+            if (memoryUsage() > budget) {
+                collect();
+            }
+        }
+    }
+
+    void cells(std::vector<CellKey> &keys) const {
+        if (worldLevel >= 0) {
+            extract(world, 0, 0, 0, keys);
+        }
+        else {
+            keys.insert(keys.end(), worldCells.begin(), worldCells.end());
+        }
+    }
+
+    void report(std::ostream &os) const {
+        os << "hashlife: " << (worldLevel >= 0 ? "power of two torus" : "light cone tiling")
+           << ", " << nrSteps << " steps, " << nodes.size() << " nodes, "
+           << nrResults << " memoized results" << std::endl;
+        os << "hashlife: " << nrHits << " result hits, " << nrMisses << " misses, "
+           << nrCollections << " collections, peak memory " << peakMemory / (1 << 20) << " MB" << std::endl;
+    }
+};
+
+#endif
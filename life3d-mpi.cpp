@@ -1,152 +1,282 @@
 //
 // Created by goncalo on 09-05-2017.
 //
-#include <set>
 #include <mpi.h>
 #include <cstdlib>
 #include <iostream>
-#include <tuple>
 #include <fstream>
-#include <unordered_set>
-#include <unordered_map>
+#include <sstream>
 #include <vector>
-#include <unistd.h>
+#include <algorithm>
+#include <omp.h>
+#include "cellset.h"
+#include "cycles.h"
+#include "allocstats.h"
+#include "placement.h"
+#include "sharedcounter.h"
+#include "torus.h"
 
 #define ARG_SIZE 3
 #define NR_SETS 32
+#define SET_BITS 5 // log2(NR_SETS)
 #define CHUNK 1
 #define OP_SEND_GENERATION 1
+#define OP_HALO_COUNT 2 // plus the receiver's ghost face
+#define OP_HALO_CELLS 8 // plus the receiver's ghost face
+// max / mean load above which a due rebalance moves work
+#define REBALANCE_THRESHOLD 1.1
 
 inline int generateIndex(int x, int y, int z);
 
-class Cell
-{
-private:
-
-    int x;
-    int y;
-    int z;
-    int index;
-
-public:
-
-    Cell() {
-
-    }
-
-    Cell(int x, int y, int z) : x(x), y(y), z(z) {
-        index = generateIndex(x, y, z);
-    }
-
-
-    inline int getX() const {
-        return x;
-    }
-
-    inline int getY() const {
-        return y;
-    }
-
-    inline int getZ() const {
-        return z;
-    }
-
-    inline int getIndex() const {
-        return index;
-    }
-
-    inline bool operator!=(Cell const &cell) const {
-        return !(*this == cell);
-    }
-
-    inline bool operator==(const Cell &cell) const {
-        return x == cell.x &&
-               y == cell.y &&
-               z == cell.z;
-    }
-
-    inline bool operator<(const Cell &cell) const {
-        return std::tie(x, y, z) < std::tie(cell.x, cell.y, cell.z);
-    }
-
-    inline friend std::ostream &operator<<(std::ostream &os, const Cell &cell) {
-        os <<  cell.x << " " << cell.y << " " << cell.z;
-        return os;
-    }
-
-    struct hash {
-        size_t operator()(Cell const &x) const noexcept
-        {
-            return ((51 + std::hash<int>()(x.getX())) *
-                    (51 + 2*std::hash<int>()(x.getY())) *
-                    (51 + 4*std::hash<int>()(x.getZ()))
-            );
-        }
-    };
-};
-
 int size, nrProcesses, id;
 bool firstTimeRoot = true;
 bool firstTimeOthers = true;
-int *cellCounter, *deadCounter;
+int *cellCounter;
 
 
 // Variables
-typedef std::unordered_set<Cell, Cell::hash> CellSet;
-typedef std::unordered_map<Cell, int, Cell::hash> DeadMap;
+typedef SharedCounter DeadMap;
 std::vector<CellSet> currentGeneration(NR_SETS);
 std::vector<CellSet> nextGeneration(NR_SETS);
 std::vector<DeadMap> deadCells(NR_SETS);
-typedef std::unordered_map<Cell, int, Cell::hash> DeadMap;
+std::vector<Fingerprint> fingerprints(NR_SETS); // of each set of the generation being built
+// increments a full deadCells table refused, refused[thread * NR_SETS + set], merged after the scan
+std::vector<std::vector<CellKey> > refused;
+// exchange buffers, kept across generations so their capacity is reused
+std::vector<int> sendBuffer, receiveBuffer;
+// (key, count) pairs of the dead cell counts owned by other processes, sent and received
+std::vector<uint64_t> deadBuffer, deadReceiveBuffer;
+std::vector<int> sendCounts, sendOffsets, receiveCounts, receiveOffsets; // per process, in ints or pairs
+unsigned long long deadCountsSent = 0;
+int firstSet, lastSet; // sets evolved by this process
+int setOwners[NR_SETS]; // the process evolving each set in the replicated mode, in runs of consecutive sets
+std::vector<unsigned long long> setLoads(NR_SETS); // live and dead cells of each set this process evolved
+unsigned long long generationLoad = 0; // live and dead cells this process went through in the last generation
+
+/*
+ * Block modes: the processes form a periodic Cartesian grid of
+ * dims[0] x dims[1] x dims[2] (slabs are the grid P x 1 x 1) and each
+ * owns the box low[a] <= c < high[a] of the torus, split into the
+ * NR_SETS sets by x and y. Besides its cells a process only holds the
+ * ghost faces: the planes just outside its box along every axis split
+ * among several processes, which its grid neighbors send it each
+ * generation. Face f is 2 * axis + side, side 0 below the box and 1
+ * above, which is also the order of the grid neighbors.
+ */
+MPI_Comm grid;
+int gridRank, gridCoords[3];
+int dims[3], low[3], high[3];
+std::vector<int> cuts[3]; // the blocks along axis a split it at cuts[a][0] = 0 < cuts[a][1] < ... < cuts[a][dims[a]] = size
+int gridNeighbors[6]; // the process across each face
+CellSet ghosts[6];
+std::vector<std::vector<CellKey> > faces; // faces[thread * 6 + f], the cells on face f of the box
+std::vector<std::vector<CellKey> > boundary(NR_SETS); // the cells of each set on a face, scanned once the ghosts are in
+std::vector<CellKey> haloSend, haloReceive;
+int haloSendCounts[6], haloSendOffsets[6], haloReceiveCounts[6], haloReceiveOffsets[6];
+unsigned long long haloCellsSent = 0;
+
+/*
+ * The exchange runs while the cells off the faces are scanned: the sends
+ * and the receives of the counts are posted up front and the receives of
+ * the cells as soon as the counts are in. The master thread polls it
+ * between sets when MPI allows calls from inside a parallel region.
+ */
+MPI_Request sendRequests[12], countRequests[6], cellRequests[6];
+bool haloPolling = false;
+bool cellsPosted;
+double haloArrival; // when the ghost cells were seen complete, negative before
+
+/*
+ * Seconds of the block generations, summed over them: posting the faces,
+ * the interior scan, the part of it the exchange overlapped (until its
+ * cells were seen complete), the wait for them after it (exposed) and
+ * the scan of the face cells.
+ */
+struct HaloTimers {
+    double post, interior, hidden, exposed, boundary;
+    long long generations;
+};
+HaloTimers haloTimers = { 0, 0, 0, 0, 0, 0 };
 
 // Function Headers
-void distributeDeadCells();
+template <class Torus> void distributeDeadCells();
+inline int setOwner(int set);
+void ownedRange();
+double loadImbalance();
+bool rebalanceSets();
+bool rebalanceBlocks();
+bool placeCuts(const double *profile, int parts, std::vector<int> &cuts);
+inline int blockOwner(const int c[3]);
+void mergeRefused();
 void evolve();
-void evolve(int n, int j);
-int getNeighbors(Cell cell, int i);
+template <class Torus> void evolve(int n, int j);
+template <class Torus> void advanceGeneration();
+Fingerprint generationFingerprint(int first, int last);
+template <class Torus> int getNeighbors(const Torus &torus, CellKey cell, int i);
 inline int* getDataToSend();
 inline int getSpaceCellSize(int j);
 inline void prepareCellData(int* data, int count);
-inline void initializeMap(std::vector<DeadMap> &maps);
-void insertDeadCell(Cell cell);
-void insertNextGeneration(Cell cell);
+void insertDeadCell(CellKey cell, int index);
+void insertNextGeneration(CellKey cell, int index);
 void prepareGeneration(int *data, int *offset);
 inline void printResults();
+bool chooseGrid(int nrProcesses, int size, int dims[3]);
+template <class Torus> void advanceBlock();
+template <class Torus> void scanCell(const Torus &torus, CellKey cell, int i);
+void postHalos();
+void postCellReceives();
+void progressHalos();
+void finishHalos();
+inline bool onFace(const int c[3]);
+inline bool inBlock(int axis, int c);
+inline int blockSet(int x, int y);
+void gatherResults();
 int arraySize;
 
+// picks the generation step for the torus class of the world size
+struct SelectKernel {
+    typedef void (*Result)();
+    bool blocks;
+
+    template <class Torus> Result pick() const {
+        return blocks ? advanceBlock<Torus> : advanceGeneration<Torus>;
+    }
+};
+
 int main(int argc, char* argv[]) {
 
     // Argument reading
-    if (argc != ARG_SIZE) {
-        std::cout << "Usage: life3d <filename> <nr of generations>" << std::endl;
+    if (argc < ARG_SIZE) {
+        std::cout << "Usage: life3d <filename> <nr of generations> [-mode replicated|slabs|blocks] [-rebalance <every>] "
+                  << "[-threshold <ratio>] [-stats] [-period] [-pin]" << std::endl;
         return -1;
     }
     std::string filename = argv[1];
     int nrGenerations = std::stoi(argv[2]);
+    bool reportPeriod = false;
+    bool stats = false;
+    bool pin = false;
+    std::string mode = "replicated";
+    int rebalanceEvery = 0;
+    double threshold = REBALANCE_THRESHOLD;
 
-    // Initial configuration
-    MPI_Status status;
+    for (int i = ARG_SIZE; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "-stats") {
+            stats = true;
+        }
+        else if (option == "-period") {
+            reportPeriod = true;
+        }
+        else if (option == "-pin") {
+            pin = true;
+        }
+        else if (option == "-mode" && i + 1 < argc) {
+            mode = argv[++i];
+        }
+        else if (option == "-rebalance" && i + 1 < argc) {
+            rebalanceEvery = std::stoi(argv[++i]);
+        }
+        else if (option == "-threshold" && i + 1 < argc) {
+            threshold = std::stod(argv[++i]);
+        }
+        else {
+            std::cout << "Unknown option: " << option << std::endl;
+            return -1;
+        }
+    }
 
+    if (mode != "replicated" && mode != "slabs" && mode != "blocks") {
+        std::cout << "Unknown mode: " << mode << std::endl;
+        return -1;
+    }
+    bool blocks = mode != "replicated";
 
+    // Initial configuration
     double elapsedTime;
 
-    MPI_Init(&argc, &argv);
+    // the master thread of a parallel region may poll the halo exchange
+    int threading;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &threading);
+    haloPolling = threading >= MPI_THREAD_FUNNELED;
     MPI_Comm_size(MPI_COMM_WORLD, &nrProcesses); //Number of processes is on nprocs
     MPI_Comm_rank(MPI_COMM_WORLD, &id); // Number of current process
+    std::vector<NodeCounters> countersBefore = nodeCounters();
+
+    // processes on one machine take consecutive CPUs, one per thread,
+    // before anything is allocated, so their tables are first touched there
+    if (pin) {
+        MPI_Comm machine;
+        int localId;
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, id, MPI_INFO_NULL, &machine);
+        MPI_Comm_rank(machine, &localId);
+        MPI_Comm_free(&machine);
+        #pragma omp parallel
+        {
+            pinThread(localId * omp_get_num_threads() + omp_get_thread_num());
+        }
+    }
+
+    // In the block modes every process reads the file and keeps its own block
+    if (blocks) {
+        std::ifstream infile(filename);
+        infile >> size;
+
+        dims[0] = nrProcesses;
+        dims[1] = dims[2] = 1;
+        bool fits = mode == "slabs" ? nrProcesses <= size : chooseGrid(nrProcesses, size, dims);
+        if (!fits) {
+            if (!id && mode == "slabs") {
+                std::cout << nrProcesses << " slabs do not fit a world of size " << size << std::endl;
+            }
+            else if (!id) {
+                std::cout << "No grid of " << nrProcesses << " blocks fits a world of size " << size << std::endl;
+            }
+            MPI_Finalize();
+            return -1;
+        }
+
+        int periods[3] = { 1, 1, 1 };
+        MPI_Cart_create(MPI_COMM_WORLD, 3, dims, periods, 1, &grid);
+        MPI_Comm_rank(grid, &gridRank);
+        MPI_Cart_coords(grid, gridRank, 3, gridCoords);
+        for (int a = 0; a < 3; a++) {
+            MPI_Cart_shift(grid, a, 1, &gridNeighbors[2 * a], &gridNeighbors[2 * a + 1]);
+        }
+        for (int a = 0; a < 3; a++) {
+            cuts[a].resize(dims[a] + 1);
+            for (int k = 0; k <= dims[a]; k++) {
+                cuts[a][k] = (int) ((int64_t) size * k / dims[a]);
+            }
+            low[a] = cuts[a][gridCoords[a]];
+            high[a] = cuts[a][gridCoords[a] + 1];
+        }
+
+        int c[3];
+        while (infile >> c[0] >> c[1] >> c[2]) {
+            if (inBlock(0, c[0]) && inBlock(1, c[1]) && inBlock(2, c[2])) {
+                int index = blockSet(c[0], c[1]);
+                if (currentGeneration[index].insert(packCell(c[0], c[1], c[2]))) {
+                    fingerprints[index].add(packCell(c[0], c[1], c[2]));
+                }
+            }
+        }
+    }
 
     // File reading
     // Only launching process reads configuration file
     // And prepares initial generation
-    if(!id){
+    if(!id && !blocks){
 
         std::ifstream infile(filename);
         infile >> size;
         int x, y, z;
         int nCells = 0;
         while (infile >> x >> y >> z) {
-            Cell cell(x, y, z);
-            int index = cell.getIndex();
-            currentGeneration[index].insert(cell);
+            int index = generateIndex(x, y, z);
+            if (currentGeneration[index].insert(packCell(x, y, z))) {
+                fingerprints[index].add(packCell(x, y, z));
+            }
             nCells++;
 
         }
@@ -158,96 +288,204 @@ int main(int argc, char* argv[]) {
 
     // Initialize set counter array
     cellCounter = new int[nrProcesses];
-    deadCounter = new int[nrProcesses];
 
-    for(int i = 0; i < nrGenerations; i++){
+    // the replicated mode starts with NR_SETS / nrProcesses sets each and the last process takes the rest
+    int share = NR_SETS / nrProcesses;
+    for (int i = 0; i < NR_SETS; i++) {
+        setOwners[i] = share == 0 ? nrProcesses - 1 : std::min(i / share, nrProcesses - 1);
+    }
+    ownedRange();
+
+    // once a generation repeats, only the position in the cycle matters;
+    // every process gets the same fingerprints, so all of them stop together
+    CycleDetector cycles;
+    cycles.record(generationFingerprint(0, NR_SETS));
+    AllocationStats allocations;
+    allocations.start();
+
+    // block processes evolve every set of their block
+    SelectKernel select = { blocks };
+    void (*advance)() = selectTorus(size, select);
+    if (blocks) {
+        firstSet = 0;
+        lastSet = NR_SETS;
+    }
 
-        //MPI_Barrier (MPI_COMM_WORLD);
-        if(!id) {
-            if(firstTimeRoot){
+    double imbalanceBefore = 0;
+    int rebalancedAt = 0;
 
-                for (int j = 1; j < nrProcesses; j++) {
-                    int *data = getDataToSend();
+    for (int i = 1; i <= nrGenerations; i++) {
+        advance();
+        allocations.generation();
 
-                    MPI_Send(data, arraySize, MPI_INT, j, OP_SEND_GENERATION, MPI_COMM_WORLD);
-                }
-                // all to all
-                firstTimeRoot = false;
+        // the generation after a rebalance shows what it achieved
+        if (rebalancedAt > 0 && rebalancedAt == i - 1) {
+            double imbalanceAfter = loadImbalance();
+            if (!id) {
+                std::cerr << "rebalanced after generation " << rebalancedAt << ": load imbalance " << imbalanceBefore
+                          << " before, " << imbalanceAfter << " after" << std::endl;
             }
-            evolve(0, NR_SETS / nrProcesses);
+        }
 
-            //evolve(0, (NR_SETS / nrProcesses) + 1);
-            //evolve(0, NR_SETS / nrProcesses);
+        int period = cycles.record(generationFingerprint(firstSet, lastSet));
+        if (period > 0) {
+            if (reportPeriod && !id) {
+                std::cerr << "period " << period << " detected at generation " << i << std::endl;
+            }
+            int remaining = (nrGenerations - i) % period;
+            for (int j = 0; j < remaining; j++) {
+                advance();
+                allocations.generation();
+            }
+            break;
+        }
 
+        if (rebalanceEvery > 0 && i % rebalanceEvery == 0 && i < nrGenerations) {
+            imbalanceBefore = loadImbalance();
+            if (imbalanceBefore > threshold && (blocks ? rebalanceBlocks() : rebalanceSets())) {
+                rebalancedAt = i;
+            }
         }
-        else{
-            if(firstTimeOthers){
+    }
 
-                // If all other non-root processes
-                int count;
+    if (stats) {
+        // written at once, so the lines of different processes do not mix
+        std::ostringstream report;
+        report << "process " << id << ": ";
+        allocations.report(report);
+        if (!blocks) {
+            report << deadCountsSent << " dead cell counts sent" << std::endl;
+        }
+        else {
+            report << "block x " << low[0] << "-" << high[0] - 1 << ", y " << low[1] << "-" << high[1] - 1
+                   << ", z " << low[2] << "-" << high[2] - 1 << " of a " << dims[0] << "x" << dims[1] << "x" << dims[2]
+                   << " grid, " << haloCellsSent << " halo cells sent" << std::endl;
+            double perGeneration = haloTimers.generations > 0 ? 1000.0 / haloTimers.generations : 0;
+            report << "per generation: " << haloTimers.post * perGeneration << " ms posting halos, "
+                   << haloTimers.interior * perGeneration << " ms interior with "
+                   << haloTimers.hidden * perGeneration << " ms of exchange hidden, "
+                   << haloTimers.exposed * perGeneration << " ms exposed, "
+                   << haloTimers.boundary * perGeneration << " ms boundary" << std::endl;
+        }
+        reportPlacement(report, countersBefore);
+        std::cerr << report.str();
+    }
 
-                // Probe for an incoming message from process zero
-                MPI_Probe(0, OP_SEND_GENERATION, MPI_COMM_WORLD, &status);
+    if (blocks) {
+        gatherResults();
+    }
+    else if(!id){
+        printResults();
+    }
 
-                // When probe returns, the status object has the size and other
-                // attributes of the incoming message. Get the message size
-                MPI_Get_count(&status, MPI_INT, &count);
 
-                // Allocate a buffer to hold the incoming numbers
-                int data[count];
 
-                MPI_Recv(data, count, MPI_INT, 0, OP_SEND_GENERATION, MPI_COMM_WORLD, &status);
+    // Final Barrier
+    MPI_Barrier (MPI_COMM_WORLD);
+    elapsedTime += MPI_Wtime();
 
-                prepareCellData(data, count);
 
-                // all to all
-                firstTimeOthers = false;
-            }
 
-            evolve((NR_SETS / nrProcesses)*id, (NR_SETS /nrProcesses)*(id+1));
+    MPI_Finalize();
 
-        }
+    return 0;
+}
 
-        // First gather the size of each set among all processes to send
-        int *dataToSend = getDataToSend();
-        int dataSizeToSend = arraySize;
-        MPI_Allgather(&dataSizeToSend, 1, MPI_INT, cellCounter, 1, MPI_INT, MPI_COMM_WORLD);
+template <class Torus>
+void advanceGeneration() {
+    MPI_Status status;
 
-        // Then ...
-        // Allocate data for the receiving array
-        int totalSizeToReceive = 0;
-        for(int m = 0; m < nrProcesses; m++){
-            totalSizeToReceive += cellCounter[m];
-        }
-        int receivedData[totalSizeToReceive];
+    //MPI_Barrier (MPI_COMM_WORLD);
+    if(!id) {
+        if(firstTimeRoot){
 
-        // Get the offset of each process
-        int offset[nrProcesses];
-        offset[0] = 0;
-        for (int j = 1; j < nrProcesses; j++) {
-            offset[j] = offset[j - 1] + cellCounter[j - 1];
+            for (int j = 1; j < nrProcesses; j++) {
+                int *data = getDataToSend();
+
+                MPI_Send(data, arraySize, MPI_INT, j, OP_SEND_GENERATION, MPI_COMM_WORLD);
+            }
+            // all to all
+            firstTimeRoot = false;
         }
+        evolve<Torus>(firstSet, lastSet);
 
-        MPI_Allgatherv(dataToSend, dataSizeToSend, MPI_INT, receivedData, cellCounter, offset ,MPI_INT, MPI_COMM_WORLD);
-        prepareGeneration(receivedData, offset);
+        //evolve(0, (NR_SETS / nrProcesses) + 1);
+        //evolve(0, NR_SETS / nrProcesses);
 
     }
+    else{
+        if(firstTimeOthers){
+
+            // If all other non-root processes
+            int count;
+
+            // Probe for an incoming message from process zero
+            MPI_Probe(0, OP_SEND_GENERATION, MPI_COMM_WORLD, &status);
+
+            // When probe returns, the status object has the size and other
+            // attributes of the incoming message. Get the message size
+            MPI_Get_count(&status, MPI_INT, &count);
+
+            // Allocate a buffer to hold the incoming numbers
+            int data[count];
+
+            MPI_Recv(data, count, MPI_INT, 0, OP_SEND_GENERATION, MPI_COMM_WORLD, &status);
+
+            prepareCellData(data, count);
+
+            // all to all
+            firstTimeOthers = false;
+        }
+
+        evolve<Torus>(firstSet, lastSet);
 
-    if(!id){
-        printResults();
     }
 
+    // First gather the size of each set among all processes to send
+    int *dataToSend = getDataToSend();
+    int dataSizeToSend = arraySize;
+    MPI_Allgather(&dataSizeToSend, 1, MPI_INT, cellCounter, 1, MPI_INT, MPI_COMM_WORLD);
 
+    // Then ...
+    // Allocate data for the receiving array
+    int totalSizeToReceive = 0;
+    for(int m = 0; m < nrProcesses; m++){
+        totalSizeToReceive += cellCounter[m];
+    }
+    receiveBuffer.resize(totalSizeToReceive);
+    int *receivedData = receiveBuffer.data();
 
-    // Final Barrier
-    MPI_Barrier (MPI_COMM_WORLD);
-    elapsedTime += MPI_Wtime();
+    // Get the offset of each process
+    int offset[nrProcesses];
+    offset[0] = 0;
+    for (int j = 1; j < nrProcesses; j++) {
+        offset[j] = offset[j - 1] + cellCounter[j - 1];
+    }
 
+    MPI_Allgatherv(dataToSend, dataSizeToSend, MPI_INT, receivedData, cellCounter, offset ,MPI_INT, MPI_COMM_WORLD);
+    prepareGeneration(receivedData, offset);
+}
 
+/**
+ * Sums the fingerprints of sets [first, last) over all processes. Each
+ * process builds the sets it evolves completely (survivors and births),
+ * so summing only those counts every cell once.
+ */
+Fingerprint generationFingerprint(int first, int last) {
+    Fingerprint local;
+    for (int i = first; i < last; i++) {
+        local.add(fingerprints[i]);
+    }
 
-    MPI_Finalize();
+    uint64_t sums[3] = { local.sum, local.sum2, local.population };
+    uint64_t total[3];
+    MPI_Allreduce(sums, total, 3, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
 
-    return 0;
+    Fingerprint fingerprint;
+    fingerprint.sum = total[0];
+    fingerprint.sum2 = total[1];
+    fingerprint.population = total[2];
+    return fingerprint;
 }
 
 inline int* getDataToSend(){
@@ -265,7 +503,8 @@ inline int* getDataToSend(){
     arraySize = sizeArray;
 
 
-    int *data = new int[sizeArray];
+    sendBuffer.resize(sizeArray);
+    int *data = sendBuffer.data();
 
 
     int index = 0;
@@ -276,10 +515,10 @@ inline int* getDataToSend(){
 
         // Iterate set
         for (auto it = set.begin(); it != set.end(); ++it) {
-            Cell cell = *it;
-            data[index] = cell.getX();
-            data[index+1] = cell.getY();
-            data[index+2] = cell.getZ();
+            CellKey cell = *it;
+            data[index] = cellX(cell);
+            data[index+1] = cellY(cell);
+            data[index+2] = cellZ(cell);
 
             index+=3;
         }
@@ -315,8 +554,7 @@ inline void prepareGeneration(int *data, int *offset){
                 j++;
             }
             else {
-                Cell cell(data[j], data[j + 1], data[j + 2]);
-                currentGeneration[index].insert(cell);
+                currentGeneration[index].insert(packCell(data[j], data[j + 1], data[j + 2]));
                 j += 3;
             }
         }
@@ -332,8 +570,7 @@ inline void prepareCellData(int *data, int count){
             nrBorders++;
             i++;
         }else{
-            Cell cell(data[i], data[i+1], data[i+2]);
-            currentGeneration[nrBorders].insert(cell);
+            currentGeneration[nrBorders].insert(packCell(data[i], data[i+1], data[i+2]));
             i+=3;
         }
     }
@@ -359,10 +596,27 @@ inline int generateIndex(int x, int y, int z) {
     return index;
 }
 
+/*
+ * generateIndex for a cell whose z is not needed. With a power of two
+ * size of at least NR_SETS, (x * NR_SETS) / size is a shift.
+ */
+inline int partitionIndex(const GenericTorus &, int x, int y) {
+    return generateIndex(x, y, 0);
+}
+
+template <int BITS>
+inline int partitionIndex(const PowerOfTwoTorus<BITS> &, int x, int y) {
+    // the inner test keeps the shift valid in instantiations that never take it
+    return BITS >= SET_BITS ? x >> (BITS >= SET_BITS ? BITS - SET_BITS : 0) : generateIndex(x, y, 0);
+}
+
+template <class Torus>
 void evolve(int initial, int end) {
-    if (id == nrProcesses - 1) { // last process does the rest
-        end = NR_SETS;
-    }
+    Torus torus(size);
+    fingerprints.assign(NR_SETS, Fingerprint());
+    setLoads.assign(NR_SETS, 0);
+    refused.resize(std::max(refused.size(), (size_t) omp_get_max_threads() * NR_SETS));
+
     #pragma omp parallel
     {
         // We will divide the current generation vector sets dynamically among various threads available
@@ -372,633 +626,976 @@ void evolve(int initial, int end) {
             CellSet &set = currentGeneration[i];
 
             for (auto it = set.begin(); it != set.end(); ++it) {
-                int neighbors = getNeighbors(*it, i);
+                int neighbors = getNeighbors(torus, *it, i);
 
-                Cell cell = *it;
                 if (neighbors >= 2 && neighbors <= 4) {
                     // with 2 to 4 neighbors the cell lives
-                    insertNextGeneration(*it);
+                    insertNextGeneration(*it, i);
                 }
             }
         }
     }
 
-    distributeDeadCells();
+    mergeRefused();
+    distributeDeadCells<Torus>();
 
     #pragma omp parallel
     {
-        // We will also divide the dead cells map dynamically among various threads available
+        // We will also divide the dead cells map dynamically among various threads available;
+        // only the owner of a set has its complete counts, so only it decides the births
         #pragma omp for schedule(dynamic, CHUNK)
-        for (int i = 0; i < NR_SETS; i++) {
+        for (int i = initial; i < end; i++) {
             // Each thread iterates through a map
             DeadMap &map = deadCells[i];
+            setLoads[i] = currentGeneration[i].size() + map.size();
 
             for (auto it = map.begin(); it != map.end(); ++it){
-
-                //std::cout << it->first << "      " << "n: " << it->second << std::endl;
-               // fflush(stdout);
-              //  usleep(100000);
-
-                if (it->second == 2 || it->second == 3) {
-                    insertNextGeneration(it->first);
-                    Cell cell = it->first;
+                if (it->count == 2 || it->count == 3) {
+                    insertNextGeneration(it->key, i);
                 }
             }
         }
+
+        // the tables are emptied, not freed, and hold the generation after next
+        #pragma omp for schedule(dynamic, CHUNK)
+        for (int i = 0; i < NR_SETS; i++) {
+            currentGeneration[i].clear();
+            deadCells[i].clear();
+        }
     }
 
-    currentGeneration = std::move(nextGeneration); // new generation is our current generation
-    nextGeneration = std::vector<CellSet>(NR_SETS);
-    for (int i = 0; i < NR_SETS; i++) {
-        initializeMap(deadCells);
+    currentGeneration.swap(nextGeneration); // new generation is our current generation
+
+    generationLoad = 0;
+    for (int i = initial; i < end; i++) {
+        generationLoad += setLoads[i];
     }
 }
 
-void distributeDeadCells(){
-    int deadNr = 0;
+/*
+ * Adds the increments refused by full deadCells tables, growing each table
+ * to fit; one thread per set, so the tables are resized in parallel and
+ * keep the capacity for the next generations.
+ */
+void mergeRefused() {
+    #pragma omp parallel for schedule(dynamic, CHUNK)
     for (int i = 0; i < NR_SETS; i++) {
-        // Each thread iterates through a map
-        DeadMap &map = deadCells[i];
+        for (size_t t = i; t < refused.size(); t += NR_SETS) {
+            std::vector<CellKey> &keys = refused[t];
+            for (size_t k = 0; k < keys.size(); k++) {
+                deadCells[i].increment(keys[k], 1);
+            }
+            keys.clear();
+        }
+    }
+}
 
-        deadNr += map.size();
+/*
+ * Sends the partial counts of the dead cells in every set this process
+ * does not own to that set's owner, and adds the counts other processes
+ * send for its own sets. The tables already hold one entry per cell, so
+ * each count crosses the network once, as a (key, count) pair, and only
+ * toward one process: the counts of cells next to another process's sets.
+ */
+template <class Torus>
+void distributeDeadCells(){
+    Torus torus(size);
+    sendCounts.assign(nrProcesses, 0);
+    sendOffsets.assign(nrProcesses, 0);
+    receiveCounts.assign(nrProcesses, 0);
+    receiveOffsets.assign(nrProcesses, 0);
 
+    for (int i = 0; i < NR_SETS; i++) {
+        if (setOwner(i) != id) {
+            sendCounts[setOwner(i)] += 2 * (int) deadCells[i].size();
+        }
     }
-    deadNr = deadNr*4;
-    int deadArray[deadNr];
+    for (int p = 1; p < nrProcesses; p++) {
+        sendOffsets[p] = sendOffsets[p - 1] + sendCounts[p - 1];
+    }
+    deadBuffer.resize(sendOffsets[nrProcesses - 1] + sendCounts[nrProcesses - 1]);
 
-    int index = 0;
-    //std::cout << "=================" << std::endl;
+    // the sets of a process are consecutive, so its pairs are too
+    size_t index = 0;
     for (int i = 0; i < NR_SETS; i++) {
+        if (setOwner(i) == id) {
+            continue;
+        }
         DeadMap &map = deadCells[i];
-        for (auto it = map.begin(); it != map.end(); ++it){
-            deadArray[index] = it->first.getX();
-            deadArray[index+1] = it->first.getY();
-            deadArray[index+2] = it->first.getZ();
-            deadArray[index+3] = it->second;
-            index+=4;
-
+        for (auto it = map.begin(); it != map.end(); ++it) {
+            deadBuffer[index] = it->key;
+            deadBuffer[index + 1] = (uint64_t) it->count;
+            index += 2;
         }
-
     }
+    deadCountsSent += index / 2;
 
-    // First gather the size of each set among all processes to send
-
-    MPI_Allgather(&deadNr, 1, MPI_INT, deadCounter, 1, MPI_INT, MPI_COMM_WORLD);
-
-    // Then ...
-    // Allocate data for the receiving array
-    int totalSizeToReceive = 0;
-    for(int m = 0; m < nrProcesses; m++){
-        totalSizeToReceive += deadCounter[m];
+    MPI_Alltoall(sendCounts.data(), 1, MPI_INT, receiveCounts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    for (int p = 1; p < nrProcesses; p++) {
+        receiveOffsets[p] = receiveOffsets[p - 1] + receiveCounts[p - 1];
     }
-    int receivedData[totalSizeToReceive];
+    deadReceiveBuffer.resize(receiveOffsets[nrProcesses - 1] + receiveCounts[nrProcesses - 1]);
 
-    // Get the offset of each process
-    int offset[nrProcesses];
-    offset[0] = 0;
-    for (int j = 1; j < nrProcesses; j++) {
-        offset[j] = offset[j - 1] + deadCounter[j - 1];
-    }
+    MPI_Alltoallv(deadBuffer.data(), sendCounts.data(), sendOffsets.data(), MPI_UINT64_T,
+                  deadReceiveBuffer.data(), receiveCounts.data(), receiveOffsets.data(), MPI_UINT64_T,
+                  MPI_COMM_WORLD);
 
-    MPI_Allgatherv(deadArray, deadNr, MPI_INT, receivedData, deadCounter, offset ,MPI_INT, MPI_COMM_WORLD);
+    for (size_t j = 0; j < deadReceiveBuffer.size(); j += 2) {
+        CellKey cell = deadReceiveBuffer[j];
+        int index = partitionIndex(torus, cellX(cell), cellY(cell));
+        deadCells[index].increment(cell, (int) deadReceiveBuffer[j + 1]);
+    }
+}
 
+// the process evolving set in the replicated mode
+inline int setOwner(int set) {
+    return setOwners[set];
+}
 
-    for (int i = 0; i < nrProcesses; i++) {
-        if (id == i) {
-            continue;
-        }
-        for (int j = offset[i]; j < deadCounter[i] + offset[i]; j+=4) {
-            Cell cell(receivedData[j], receivedData[j + 1], receivedData[j + 2]);
-            deadCells[cell.getIndex()][cell] += receivedData[j+3];
-            //std::cout << "cell: " << cell << " nr: " << receivedData[j+3]<< " contador: " << deadCells[cell.getIndex()][cell] << std::endl;
-            usleep(10000);
+// firstSet and lastSet from setOwners; a process may own no set
+void ownedRange() {
+    firstSet = lastSet = 0;
+    for (int i = 0; i < NR_SETS; i++) {
+        if (setOwners[i] == id) {
+            if (firstSet == lastSet) {
+                firstSet = i;
+            }
+            lastSet = i + 1;
         }
     }
 }
 
-int getNeighbors(Cell cell, int vectorIndex) {
-    int nrNeighbors = 0;
-    int x = cell.getX();
-    int y = cell.getY();
-    int z = cell.getZ();
-    int xx, yy, zz;
-
-    Cell cell1;
-    Cell cell2;
-    Cell cell3;
-    Cell cell4;
-    Cell cell5;
-    Cell cell6;
+// the max / mean of the loads of the last generation over the processes
+double loadImbalance() {
+    unsigned long long largest, total;
+    MPI_Allreduce(&generationLoad, &largest, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Allreduce(&generationLoad, &total, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    double mean = (double) total / nrProcesses;
+    return mean > 0 ? largest / mean : 1.0;
+}
 
-    if (x - 1 < 0) {
-        xx = size - 1;
-        cell1 = Cell(xx, y, z);
-    }
-    else {
-        cell1 = Cell(x - 1, y, z);
-    }
+/*
+ * Gives each process a run of consecutive sets with about the same load,
+ * the live and dead cells of each set in the last generation: a set goes
+ * to the process whose share of the total load its middle falls in.
+ * Every process holds the whole world, so no cell moves, and all of them
+ * compute the same owners from the same loads. Returns whether any set
+ * changed owner.
+ */
+bool rebalanceSets() {
+    std::vector<unsigned long long> loads(NR_SETS);
+    MPI_Allreduce(setLoads.data(), loads.data(), NR_SETS, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
 
-    if (x + 1 >= size) {
-        xx = 0;
-        cell2 = Cell(xx, y, z);
+    double total = 0;
+    for (int i = 0; i < NR_SETS; i++) {
+        total += loads[i];
     }
-    else {
-        cell2 = Cell(x + 1, y, z);
+    if (total == 0) {
+        return false;
     }
 
-    if (y - 1 < 0) {
-        yy = size - 1;
-        cell3 = Cell(x, yy, z);
-    }
-    else {
-        cell3 = Cell(x, y - 1, z);
+    bool moved = false;
+    double prefix = 0;
+    for (int i = 0; i < NR_SETS; i++) {
+        int owner = std::min(nrProcesses - 1, (int) ((prefix + loads[i] / 2.0) * nrProcesses / total));
+        moved = moved || owner != setOwners[i];
+        setOwners[i] = owner;
+        prefix += loads[i];
     }
+    ownedRange();
+    return moved;
+}
 
-    if (y + 1 >= size) {
-        yy = 0;
-        cell4 = Cell(x, yy, z);
-    }
-    else {
-        cell4 = Cell(x, y + 1, z);
-    }
+template <class Torus>
+int getNeighbors(const Torus &torus, CellKey cell, int vectorIndex) {
+    int nrNeighbors = 0;
+    int x = cellX(cell);
+    int y = cellY(cell);
+    int z = cellZ(cell);
+    int xx, yy, zz;
 
-    if (z - 1 < 0) {
-        zz = size - 1;
-        cell5 = Cell(x, y, zz);
-    }
-    else {
-        cell5 = Cell(x, y, z - 1);
-    }
+    CellKey neighbors[6];
+    int indexes[6];
 
-    if (z + 1 >= size) {
-        zz = 0;
-        cell6 = Cell(x, y, zz);
-    }
-    else {
-        cell6 = Cell(x, y, z + 1);
-    }
+    xx = torus.down(x);
+    neighbors[0] = packCell(xx, y, z);
+    indexes[0] = partitionIndex(torus, xx, y);
 
-    if (currentGeneration[cell1.getIndex()].count(cell1) > 0) {
-        nrNeighbors++;
-    }
-    else {
-        insertDeadCell(cell1);
-    }
+    xx = torus.up(x);
+    neighbors[1] = packCell(xx, y, z);
+    indexes[1] = partitionIndex(torus, xx, y);
 
-    if (currentGeneration[cell2.getIndex()].count(cell2) > 0) {
-        nrNeighbors++;
-    }
-    else {
-        insertDeadCell(cell2);
-    }
+    yy = torus.down(y);
+    neighbors[2] = packCell(x, yy, z);
+    indexes[2] = partitionIndex(torus, x, yy);
 
-    if (currentGeneration[cell3.getIndex()].count(cell3) > 0) {
-        nrNeighbors++;
-    }
-    else {
-        insertDeadCell(cell3);
-    }
+    yy = torus.up(y);
+    neighbors[3] = packCell(x, yy, z);
+    indexes[3] = partitionIndex(torus, x, yy);
 
-    if (currentGeneration[cell4.getIndex()].count(cell4) > 0) {
-        nrNeighbors++;
-    }
-    else {
-        insertDeadCell(cell4);
-    }
+    // z does not take part in the partition index
+    zz = torus.down(z);
+    neighbors[4] = packCell(x, y, zz);
+    indexes[4] = vectorIndex;
 
-    if (currentGeneration[cell5.getIndex()].count(cell5) > 0) {
-        nrNeighbors++;
-    }
-    else {
-        insertDeadCell(cell5);
-    }
+    zz = torus.up(z);
+    neighbors[5] = packCell(x, y, zz);
+    indexes[5] = vectorIndex;
 
-    if (currentGeneration[cell6.getIndex()].count(cell6) > 0) {
-        nrNeighbors++;
-    }
-    else {
-        insertDeadCell(cell6);
+    for (int i = 0; i < 6; i++) {
+        if (currentGeneration[indexes[i]].contains(neighbors[i])) {
+            nrNeighbors++;
+        }
+        else {
+            insertDeadCell(neighbors[i], indexes[i]);
+        }
     }
 
     return nrNeighbors;
 }
 
-void insertNextGeneration(Cell cell) {
-    int index = cell.getIndex();
-
+void insertNextGeneration(CellKey cell, int index) {
     switch(index){
         case 0 :
         #pragma omp critical (nextGeneration_0)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 1 :
         #pragma omp critical (nextGeneration_1)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 2 :
         #pragma omp critical (nextGeneration_2)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 3 :
         #pragma omp critical (nextGeneration_3)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 4 :
         #pragma omp critical (nextGeneration_4)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 5 :
         #pragma omp critical (nextGeneration_5)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 6 :
         #pragma omp critical (nextGeneration_6)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 7 :
         #pragma omp critical (nextGeneration_7)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 8 :
         #pragma omp critical (nextGeneration_8)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 9 :
         #pragma omp critical (nextGeneration_9)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 10 :
         #pragma omp critical (nextGeneration_10)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 11 :
         #pragma omp critical (nextGeneration_11)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 12 :
         #pragma omp critical (nextGeneration_12)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 13 :
         #pragma omp critical (nextGeneration_13)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 14 :
         #pragma omp critical (nextGeneration_14)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 15 :
         #pragma omp critical (nextGeneration_15)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 16 :
         #pragma omp critical (nextGeneration_16)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 17 :
         #pragma omp critical (nextGeneration_17)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 18 :
         #pragma omp critical (nextGeneration_18)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 19 :
         #pragma omp critical (nextGeneration_19)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 20 :
         #pragma omp critical (nextGeneration_20)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 21 :
         #pragma omp critical (nextGeneration_21)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 22 :
         #pragma omp critical (nextGeneration_22)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 23 :
         #pragma omp critical (nextGeneration_23)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 24 :
         #pragma omp critical (nextGeneration_24)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 25 :
         #pragma omp critical (nextGeneration_25)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 26 :
         #pragma omp critical (nextGeneration_26)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 27 :
         #pragma omp critical (nextGeneration_27)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 28 :
         #pragma omp critical (nextGeneration_28)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 29 :
         #pragma omp critical (nextGeneration_29)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 30 :
         #pragma omp critical (nextGeneration_30)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
         case 31 :
         #pragma omp critical (nextGeneration_31)
         {
-            nextGeneration[index].insert(cell);
+            if (nextGeneration[index].insert(cell)) {
+                fingerprints[index].add(cell);
+            }
         }
             break;
     }
 }
 
-void insertDeadCell(Cell cell) {
-    int index = cell.getIndex();
+// lock-free; a refused increment waits for mergeRefused
+void insertDeadCell(CellKey cell, int index) {
+    if (!deadCells[index].add(cell, 1)) {
+        refused[(size_t) omp_get_thread_num() * NR_SETS + index].push_back(cell);
+    }
+}
 
-    switch(index){
-        case 0 :
-        #pragma omp critical (deadCells_0)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 1 :
-        #pragma omp critical (deadCells_1)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 2 :
-        #pragma omp critical (deadCells_2)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 3 :
-        #pragma omp critical (deadCells_3)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 4 :
-        #pragma omp critical (deadCells_4)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 5 :
-        #pragma omp critical (deadCells_5)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 6 :
-        #pragma omp critical (deadCells_6)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 7 :
-        #pragma omp critical (deadCells_7)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 8 :
-        #pragma omp critical (deadCells_8)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 9 :
-        #pragma omp critical (deadCells_9)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 10 :
-        #pragma omp critical (deadCells_10)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 11 :
-        #pragma omp critical (deadCells_11)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 12 :
-        #pragma omp critical (deadCells_12)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 13 :
-        #pragma omp critical (deadCells_13)
-        {
-            deadCells[index][cell] += 1;
-        }
-            break;
-        case 14 :
-        #pragma omp critical (deadCells_14)
-        {
-            deadCells[index][cell] += 1;
+/* Aux functions for printing data */
+/*
+ * Picks the grid for nrProcesses blocks that exchanges the fewest halo
+ * cells per process: each axis split among d > 1 processes costs the two
+ * faces across it, the product of the block's other two extents. No
+ * axis is split into more parts than it has planes. Returns false when no
+ * grid fits.
+ */
+bool chooseGrid(int nrProcesses, int size, int dims[3]) {
+    double best = -1;
+    for (int a = 1; a <= nrProcesses && a <= size; a++) {
+        if (nrProcesses % a != 0) {
+            continue;
         }
-            break;
-        case 15 :
-        #pragma omp critical (deadCells_15)
-        {
-            deadCells[index][cell] += 1;
+        for (int b = 1; b <= nrProcesses / a && b <= size; b++) {
+            if ((nrProcesses / a) % b != 0 || nrProcesses / a / b > size) {
+                continue;
+            }
+            int split[3] = { a, b, nrProcesses / a / b };
+            double extent[3] = { (double) size / split[0], (double) size / split[1], (double) size / split[2] };
+            double halo = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                if (split[axis] > 1) {
+                    halo += 2 * extent[(axis + 1) % 3] * extent[(axis + 2) % 3];
+                }
+            }
+            if (best < 0 || halo < best) {
+                best = halo;
+                std::copy(split, split + 3, dims);
+            }
         }
-            break;
-        case 16 :
-        #pragma omp critical (deadCells_16)
-        {
-            deadCells[index][cell] += 1;
+    }
+    return best >= 0;
+}
+
+/*
+ * One generation of a block. The faces are posted first, and while they
+ * travel the cells off the faces are scanned: their neighbors are all in
+ * the block. The face cells wait for the ghosts, which they probe for
+ * neighbors across the faces, and each ghost cell adds 1 to its neighbor
+ * inside the block. Dead cells outside the block are left to the
+ * process that owns them.
+ */
+template <class Torus>
+void advanceBlock() {
+    Torus torus(size);
+    refused.resize(std::max(refused.size(), (size_t) omp_get_max_threads() * NR_SETS));
+
+    double started = MPI_Wtime();
+    postHalos();
+    double posted = MPI_Wtime();
+
+    #pragma omp parallel
+    {
+        #pragma omp for schedule(dynamic, CHUNK)
+        for (int i = 0; i < NR_SETS; i++) {
+            CellSet &set = currentGeneration[i];
+            fingerprints[i] = Fingerprint();
+
+            for (auto it = set.begin(); it != set.end(); ++it) {
+                int c[3] = { cellX(*it), cellY(*it), cellZ(*it) };
+                if (!onFace(c)) {
+                    scanCell(torus, *it, i);
+                }
+            }
+
+            // MPI only progresses inside its calls, so the master thread calls in between sets
+            if (haloPolling && omp_get_thread_num() == 0) {
+                progressHalos();
+            }
         }
-            break;
-        case 17 :
-        #pragma omp critical (deadCells_17)
-        {
-            deadCells[index][cell] += 1;
+    }
+
+    double scanned = MPI_Wtime();
+    finishHalos();
+    double arrived = MPI_Wtime();
+
+    #pragma omp parallel
+    {
+        #pragma omp for schedule(dynamic, CHUNK)
+        for (int i = 0; i < NR_SETS; i++) {
+            for (size_t k = 0; k < boundary[i].size(); k++) {
+                scanCell(torus, boundary[i][k], i);
+            }
+            boundary[i].clear();
         }
-            break;
-        case 18 :
-        #pragma omp critical (deadCells_18)
-        {
-            deadCells[index][cell] += 1;
+
+        // the ghosts' neighbors across the faces, in the outer planes of the block
+        #pragma omp for schedule(dynamic, CHUNK)
+        for (int f = 0; f < 6; f++) {
+            int axis = f / 2;
+            for (auto it = ghosts[f].begin(); it != ghosts[f].end(); ++it) {
+                int c[3] = { cellX(*it), cellY(*it), cellZ(*it) };
+                c[axis] = f % 2 == 0 ? low[axis] : high[axis] - 1;
+                CellKey inside = packCell(c[0], c[1], c[2]);
+                int index = blockSet(c[0], c[1]);
+                if (!currentGeneration[index].contains(inside)) {
+                    insertDeadCell(inside, index);
+                }
+            }
         }
-            break;
-        case 19 :
-        #pragma omp critical (deadCells_19)
-        {
-            deadCells[index][cell] += 1;
+    }
+
+    double finished = MPI_Wtime();
+    haloTimers.post += posted - started;
+    haloTimers.interior += scanned - posted;
+    haloTimers.hidden += std::min(haloArrival, scanned) - posted;
+    haloTimers.exposed += arrived - scanned;
+    haloTimers.boundary += finished - arrived;
+    haloTimers.generations++;
+
+    mergeRefused();
+
+    generationLoad = 0;
+    for (int i = 0; i < NR_SETS; i++) {
+        generationLoad += currentGeneration[i].size() + deadCells[i].size();
+    }
+
+    #pragma omp parallel for schedule(dynamic, CHUNK)
+    for (int i = 0; i < NR_SETS; i++) {
+        DeadMap &map = deadCells[i];
+        for (auto it = map.begin(); it != map.end(); ++it) {
+            if ((it->count == 2 || it->count == 3) && nextGeneration[i].insert(it->key)) {
+                fingerprints[i].add(it->key);
+            }
         }
-            break;
-        case 20 :
-        #pragma omp critical (deadCells_20)
-        {
-            deadCells[index][cell] += 1;
+
+        // the tables are emptied, not freed, and hold the generation after next
+        currentGeneration[i].clear();
+        deadCells[i].clear();
+        std::swap(currentGeneration[i], nextGeneration[i]);
+    }
+}
+
+/*
+ * Scans live cell of set i: counts its live neighbors, in the block or
+ * in the ghost faces, adds 1 to each dead one in the block and keeps the
+ * cell if it survives. Only the thread scanning set i may call it.
+ */
+template <class Torus>
+void scanCell(const Torus &torus, CellKey cell, int i) {
+    int c[3] = { cellX(cell), cellY(cell), cellZ(cell) };
+    int alive = 0;
+
+    // neighbor f is across face f: one step down or up along axis f / 2
+    for (int f = 0; f < 6; f++) {
+        int n[3] = { c[0], c[1], c[2] };
+        n[f / 2] = f % 2 == 0 ? torus.down(c[f / 2]) : torus.up(c[f / 2]);
+        CellKey neighbor = packCell(n[0], n[1], n[2]);
+
+        if (inBlock(f / 2, n[f / 2])) {
+            int index = blockSet(n[0], n[1]);
+            if (currentGeneration[index].contains(neighbor)) {
+                alive++;
+            }
+            else {
+                insertDeadCell(neighbor, index);
+            }
         }
-            break;
-        case 21 :
-        #pragma omp critical (deadCells_21)
-        {
-            deadCells[index][cell] += 1;
+        else if (ghosts[f].contains(neighbor)) {
+            alive++;
         }
-            break;
-        case 22 :
-        #pragma omp critical (deadCells_22)
-        {
-            deadCells[index][cell] += 1;
+    }
+
+    if (alive >= 2 && alive <= 4 && nextGeneration[i].insert(cell)) {
+        fingerprints[i].add(cell);
+    }
+}
+
+/*
+ * Collects the cells on every face of the block, and each set's cells on
+ * any face into boundary, then posts the sends to the grid neighbors
+ * across the faces, counts first, and the receives of their counts. The
+ * receives of the cells are posted once their counts arrive, by
+ * progressHalos or finishHalos. Axes the grid does not split have no
+ * faces to send and receive none.
+ */
+void postHalos() {
+    faces.resize(std::max(faces.size(), (size_t) omp_get_max_threads() * 6));
+
+    #pragma omp parallel
+    {
+        std::vector<CellKey> *mine = &faces[(size_t) omp_get_thread_num() * 6];
+
+        #pragma omp for schedule(dynamic, CHUNK)
+        for (int i = 0; i < NR_SETS; i++) {
+            CellSet &set = currentGeneration[i];
+            for (auto it = set.begin(); it != set.end(); ++it) {
+                int c[3] = { cellX(*it), cellY(*it), cellZ(*it) };
+                if (!onFace(c)) {
+                    continue;
+                }
+                boundary[i].push_back(*it);
+                for (int axis = 0; axis < 3; axis++) {
+                    if (dims[axis] == 1) {
+                        continue;
+                    }
+                    if (c[axis] == low[axis]) {
+                        mine[2 * axis].push_back(*it);
+                    }
+                    if (c[axis] == high[axis] - 1) {
+                        mine[2 * axis + 1].push_back(*it);
+                    }
+                }
+            }
         }
-            break;
-        case 23 :
-        #pragma omp critical (deadCells_23)
-        {
-            deadCells[index][cell] += 1;
+    }
+
+    haloSend.clear();
+    for (int f = 0; f < 6; f++) {
+        haloSendOffsets[f] = (int) haloSend.size();
+        for (size_t t = f; t < faces.size(); t += 6) {
+            haloSend.insert(haloSend.end(), faces[t].begin(), faces[t].end());
+            faces[t].clear();
         }
-            break;
-        case 24 :
-        #pragma omp critical (deadCells_24)
-        {
-            deadCells[index][cell] += 1;
+        haloSendCounts[f] = (int) haloSend.size() - haloSendOffsets[f];
+    }
+    haloCellsSent += haloSend.size();
+
+    // the cells on face f become the ghost face f ^ 1 of the neighbor across it, which tags tell apart
+    for (int f = 0; f < 6; f++) {
+        sendRequests[f] = sendRequests[6 + f] = countRequests[f] = cellRequests[f] = MPI_REQUEST_NULL;
+        if (dims[f / 2] == 1) {
+            continue;
         }
-            break;
-        case 25 :
-        #pragma omp critical (deadCells_25)
-        {
-            deadCells[index][cell] += 1;
+        MPI_Irecv(&haloReceiveCounts[f], 1, MPI_INT, gridNeighbors[f], OP_HALO_COUNT + f, grid, &countRequests[f]);
+        MPI_Isend(&haloSendCounts[f], 1, MPI_INT, gridNeighbors[f], OP_HALO_COUNT + (f ^ 1), grid, &sendRequests[f]);
+        MPI_Isend(haloSend.data() + haloSendOffsets[f], haloSendCounts[f], MPI_UINT64_T, gridNeighbors[f],
+                  OP_HALO_CELLS + (f ^ 1), grid, &sendRequests[6 + f]);
+    }
+    cellsPosted = false;
+    haloArrival = -1;
+}
+
+// posts the receives of the ghost cells, once every count is in
+void postCellReceives() {
+    int total = 0;
+    for (int f = 0; f < 6; f++) {
+        haloReceiveOffsets[f] = total;
+        total += dims[f / 2] == 1 ? 0 : haloReceiveCounts[f];
+    }
+    haloReceive.resize(total);
+    for (int f = 0; f < 6; f++) {
+        if (dims[f / 2] > 1) {
+            MPI_Irecv(haloReceive.data() + haloReceiveOffsets[f], haloReceiveCounts[f], MPI_UINT64_T,
+                      gridNeighbors[f], OP_HALO_CELLS + f, grid, &cellRequests[f]);
         }
-            break;
-        case 26 :
-        #pragma omp critical (deadCells_26)
-        {
-            deadCells[index][cell] += 1;
+    }
+    cellsPosted = true;
+}
+
+// moves the exchange on without blocking, and notes when the ghost cells are in
+void progressHalos() {
+    int done;
+    if (!cellsPosted) {
+        MPI_Testall(6, countRequests, &done, MPI_STATUSES_IGNORE);
+        if (!done) {
+            return;
         }
-            break;
-        case 27 :
-        #pragma omp critical (deadCells_27)
-        {
-            deadCells[index][cell] += 1;
+        postCellReceives();
+    }
+    if (haloArrival < 0) {
+        MPI_Testall(6, cellRequests, &done, MPI_STATUSES_IGNORE);
+        if (done) {
+            haloArrival = MPI_Wtime();
         }
-            break;
-        case 28 :
-        #pragma omp critical (deadCells_28)
-        {
-            deadCells[index][cell] += 1;
+    }
+}
+
+// waits for what is left of the exchange and turns the received planes into the ghost faces
+void finishHalos() {
+    MPI_Waitall(6, countRequests, MPI_STATUSES_IGNORE);
+    if (!cellsPosted) {
+        postCellReceives();
+    }
+    MPI_Waitall(6, cellRequests, MPI_STATUSES_IGNORE);
+    if (haloArrival < 0) {
+        haloArrival = MPI_Wtime();
+    }
+    MPI_Waitall(12, sendRequests, MPI_STATUSES_IGNORE);
+
+    #pragma omp parallel for
+    for (int f = 0; f < 6; f++) {
+        ghosts[f].clear();
+        int count = dims[f / 2] == 1 ? 0 : haloReceiveCounts[f];
+        for (int k = 0; k < count; k++) {
+            ghosts[f].insert(haloReceive[haloReceiveOffsets[f] + k]);
         }
-            break;
-        case 29 :
-        #pragma omp critical (deadCells_29)
-        {
-            deadCells[index][cell] += 1;
+    }
+}
+
+// whether a cell of the block is on one of its faces, next to another process's block
+inline bool onFace(const int c[3]) {
+    for (int axis = 0; axis < 3; axis++) {
+        if (dims[axis] > 1 && (c[axis] == low[axis] || c[axis] == high[axis] - 1)) {
+            return true;
         }
-            break;
-        case 30 :
-        #pragma omp critical (deadCells_30)
-        {
-            deadCells[index][cell] += 1;
+    }
+    return false;
+}
+
+// whether coordinate c on axis is in this process's block; always, on an axis the grid does not split
+inline bool inBlock(int axis, int c) {
+    return dims[axis] == 1 || (c >= low[axis] && c < high[axis]);
+}
+
+// the set of a cell of the block, sets being ranges of its (x, y) columns
+inline int blockSet(int x, int y) {
+    int64_t width = high[1] - low[1];
+    int64_t column = (int64_t) (x - low[0]) * width + (y - low[1]);
+    return (int) (column * NR_SETS / ((high[0] - low[0]) * width));
+}
+
+/*
+ * Moves the cuts of every split axis so that each range of planes holds
+ * about the same load, then sends the cells that left the block to their
+ * new owners in one MPI_Alltoallv. The load of a plane is the sum over
+ * its live cells of their process's load per live cell in the last
+ * generation, which brings in the dead cells around them. The cuts are
+ * shared by a whole axis, so blocks stay face to face with one neighbor
+ * each way and only the marginal loads along the axes are balanced.
+ * Returns whether any cut moved; every process gets the same answer.
+ */
+bool rebalanceBlocks() {
+    size_t live = 0;
+    for (int i = 0; i < NR_SETS; i++) {
+        live += currentGeneration[i].size();
+    }
+    double weight = live > 0 ? (double) generationLoad / live : 0;
+
+    std::vector<double> profile(3 * (size_t) size, 0.0), total(3 * (size_t) size);
+    for (int i = 0; i < NR_SETS; i++) {
+        for (auto it = currentGeneration[i].begin(); it != currentGeneration[i].end(); ++it) {
+            int c[3] = { cellX(*it), cellY(*it), cellZ(*it) };
+            for (int axis = 0; axis < 3; axis++) {
+                profile[(size_t) axis * size + c[axis]] += weight;
+            }
         }
-            break;
-        case 31 :
-        #pragma omp critical (deadCells_31)
-        {
-            deadCells[index][cell] += 1;
+    }
+    MPI_Allreduce(profile.data(), total.data(), 3 * size, MPI_DOUBLE, MPI_SUM, grid);
+    bool moved = false;
+    for (int axis = 0; axis < 3; axis++) {
+        if (dims[axis] > 1 && placeCuts(&total[(size_t) axis * size], dims[axis], cuts[axis])) {
+            moved = true;
+        }
+        low[axis] = cuts[axis][gridCoords[axis]];
+        high[axis] = cuts[axis][gridCoords[axis] + 1];
+    }
+    if (!moved) {
+        return false;
+    }
+
+    // the leaving cells, grouped by new owner
+    std::vector<CellKey> kept, leaving;
+    std::vector<int> owners;
+    std::vector<int> counts(nrProcesses, 0), offsets(nrProcesses, 0);
+    std::vector<int> arrivingCounts(nrProcesses), arrivingOffsets(nrProcesses, 0);
+    for (int i = 0; i < NR_SETS; i++) {
+        for (auto it = currentGeneration[i].begin(); it != currentGeneration[i].end(); ++it) {
+            int c[3] = { cellX(*it), cellY(*it), cellZ(*it) };
+            if (inBlock(0, c[0]) && inBlock(1, c[1]) && inBlock(2, c[2])) {
+                kept.push_back(*it);
+            }
+            else {
+                leaving.push_back(*it);
+                owners.push_back(blockOwner(c));
+                counts[owners.back()]++;
+            }
         }
-            break;
+        currentGeneration[i].clear();
+    }
+    for (int p = 1; p < nrProcesses; p++) {
+        offsets[p] = offsets[p - 1] + counts[p - 1];
     }
+    std::vector<CellKey> outgoing(leaving.size());
+    std::vector<int> next(offsets);
+    for (size_t k = 0; k < leaving.size(); k++) {
+        outgoing[next[owners[k]]++] = leaving[k];
+    }
+
+    MPI_Alltoall(counts.data(), 1, MPI_INT, arrivingCounts.data(), 1, MPI_INT, grid);
+    for (int p = 1; p < nrProcesses; p++) {
+        arrivingOffsets[p] = arrivingOffsets[p - 1] + arrivingCounts[p - 1];
+    }
+    std::vector<CellKey> arriving(arrivingOffsets[nrProcesses - 1] + arrivingCounts[nrProcesses - 1]);
+    MPI_Alltoallv(outgoing.data(), counts.data(), offsets.data(), MPI_UINT64_T,
+                  arriving.data(), arrivingCounts.data(), arrivingOffsets.data(), MPI_UINT64_T, grid);
+
+    // the sets are ranges of the new block's columns
+    kept.insert(kept.end(), arriving.begin(), arriving.end());
+    for (size_t k = 0; k < kept.size(); k++) {
+        currentGeneration[blockSet(cellX(kept[k]), cellY(kept[k]))].insert(kept[k]);
+    }
+    return true;
 }
 
-inline void initializeMap(std::vector<DeadMap> &maps) {
+/*
+ * Splits the planes of an axis into parts ranges of about the same load,
+ * each cut next to the plane where the running load crosses its share,
+ * and every range keeping at least one plane. Returns whether a cut
+ * moved.
+ */
+bool placeCuts(const double *profile, int parts, std::vector<int> &cuts) {
+    double total = 0;
+    for (int c = 0; c < size; c++) {
+        total += profile[c];
+    }
+    if (total <= 0) {
+        return false;
+    }
+
+    bool moved = false;
+    double prefix = 0;
+    int c = 0;
+    for (int k = 1; k < parts; k++) {
+        double target = total * k / parts;
+        while (c < size && prefix < target) {
+            prefix += profile[c];
+            c++;
+        }
+        // the cut goes before the crossing plane when that is closer to the share
+        int cut = c > 0 && prefix - target > profile[c - 1] / 2 ? c - 1 : c;
+        cut = std::min(std::max(cut, cuts[k - 1] + 1), size - (parts - k));
+        moved = moved || cut != cuts[k];
+        cuts[k] = cut;
+    }
+    return moved;
+}
+
+// the rank in grid of the process whose block holds cell c
+inline int blockOwner(const int c[3]) {
+    int at[3], rank;
+    for (int axis = 0; axis < 3; axis++) {
+        at[axis] = (int) (std::upper_bound(cuts[axis].begin(), cuts[axis].end(), c[axis]) - cuts[axis].begin()) - 1;
+    }
+    MPI_Cart_rank(grid, at, &rank);
+    return rank;
+}
+
+// the root collects every block once, at the end, and prints the world
+void gatherResults() {
+    std::vector<CellKey> cells;
     for (int i = 0; i < NR_SETS; i++) {
-        DeadMap map;
-        maps[i] = map;
+        cells.insert(cells.end(), currentGeneration[i].begin(), currentGeneration[i].end());
+    }
+
+    int count = (int) cells.size();
+    std::vector<int> counts(nrProcesses), offsets(nrProcesses, 0);
+    MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    std::vector<CellKey> world;
+    if (!id) {
+        for (int p = 1; p < nrProcesses; p++) {
+            offsets[p] = offsets[p - 1] + counts[p - 1];
+        }
+        world.resize(offsets[nrProcesses - 1] + counts[nrProcesses - 1]);
+    }
+    MPI_Gatherv(cells.data(), count, MPI_UINT64_T, world.data(), counts.data(), offsets.data(),
+                MPI_UINT64_T, 0, MPI_COMM_WORLD);
+
+    if (!id) {
+        printCells(world);
     }
 }
 
-/* Aux functions for printing data */
 inline void printResults() {
-    std::set<Cell> lastGeneration;
+    std::vector<CellKey> lastGeneration;
 
     for (int i = 0; i < NR_SETS; i++) {
        //std::cout << currentGeneration[i].size() << std::endl;
-        lastGeneration.insert(currentGeneration[i].begin(),
+        lastGeneration.insert(lastGeneration.end(),
+                              currentGeneration[i].begin(),
                               currentGeneration[i].end());
     }
 
-    for (auto it = lastGeneration.begin(); it != lastGeneration.end(); ++it) {
-        std::cout << *it << std::endl;
-    }
-}
\ No newline at end of file
+    printCells(lastGeneration);
+}
@@ -1,109 +1,163 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <set>
-#include <unordered_set>
-#include <unordered_map>
-#include <tuple>
 #include <utility>
+#include <algorithm>
+#include <memory>
 #include <omp.h>
+#include "cellset.h"
+#include "sortengine.h"
+#include "cycles.h"
+#include "torus.h"
+#include "allocstats.h"
+#include "partition.h"
+#include "placement.h"
+#include "sharedcounter.h"
 
 #define ARG_SIZE 3
-#define NR_SETS 32
-#define CHUNK 4
+#define CACHE_LINE 64
+#define TASK_GRAIN 2048 // live cells scanned by one task, about
 
-inline int generateIndex(int x, int y, int z);
+int size;
+int index = 0;
 
-class Cell
-{
-private:
+// the world is split into nrSets sets, one per partition
+Partitioning partitions;
+int nrSets;
 
-    int x;
-    int y;
-    int z;
-    int index;
+// new data structures
+typedef CellCounter DeadMap;
+
+std::vector<CellSet> currentGeneration;
+std::vector<CellSet> nextGeneration;
+std::vector<DeadMap> deadCells;
+std::vector<Fingerprint> fingerprints; // of each set of the generation being built
+
+/*
+ * Count increments staged per thread and per destination set: the keys
+ * in staged[thread * nrSets + set] each add 1 to their count in
+ * deadCells[set]. Threads only append to their own buffers, and each set
+ * is merged by the one thread that owns it, so the evolve loops take no
+ * locks and use no atomics.
+ */
+std::vector<std::vector<CellKey> > staged;
+
+/*
+ * With -counts shared the scans add straight into one lock-free table per
+ * set (see sharedcounter.h) and stage only the increments a full table
+ * refuses; the set's owner merges those after growing its table.
+ */
+std::vector<SharedCounter> sharedCounts;
+
+// the count tables of the kernels instantiated for Counts
+template <class Counts> std::vector<Counts> &countTables();
+
+template <> inline std::vector<DeadMap> &countTables<DeadMap>() {
+    return deadCells;
+}
 
-public:
+template <> inline std::vector<SharedCounter> &countTables<SharedCounter>() {
+    return sharedCounts;
+}
 
-    Cell() {
-    
-    }
+// adds 1 to the count of key in set index, or stages it for the owner of the set
+template <class Counts> void countNeighbor(std::vector<CellKey> *stage, int index, CellKey key);
+
+template <> inline void countNeighbor<DeadMap>(std::vector<CellKey> *stage, int index, CellKey key) {
+    stage[index].push_back(key);
+}
 
-    Cell(int x, int y, int z) : x(x), y(y), z(z) {
-        index = generateIndex(x, y, z);
+template <> inline void countNeighbor<SharedCounter>(std::vector<CellKey> *stage, int index, CellKey key) {
+    if (!sharedCounts[index].add(key, 1)) {
+        stage[index].push_back(key);
     }
+}
 
+/*
+ * What the owner-computes engine writes while evolving a partition: its
+ * dead cell counts, its next generation and outboxes holding the count
+ * increments for each other partition. Allocated by the owning thread
+ * and padded on both sides, so no two owners write to one cache line.
+ */
+struct OwnerState {
+    char before[CACHE_LINE];
+    DeadMap counts;
+    CellSet next;
+    Fingerprint fingerprint;
+    std::vector<std::vector<CellKey> > outbox; // outbox[partition]
+    char after[CACHE_LINE];
 
-    inline int getX() const {
-        return x;
-    }
+    explicit OwnerState(int nrPartitions) : outbox(nrPartitions) {
 
-    inline int getY() const {
-        return y;
     }
+};
 
-    inline int getZ() const {
-        return z;
-    }
+std::vector<std::unique_ptr<OwnerState> > owners; // owners[partition]
 
-    inline int getIndex() const {
-        return index;
-    }
+// survivors of the probe kernel under the task scheduler, staged like the counts
+std::vector<std::vector<CellKey> > stagedSurvivors;
 
-    inline bool operator!=(Cell const &cell) const { 
-        return !(*this == cell); 
-    }
+/*
+ * Busy time of each thread in the evolve parallel region, one per cache
+ * line; the rest of parallelTime is the time the thread sat idle.
+ */
+struct ThreadClock {
+    double busy;
+    char pad[CACHE_LINE - sizeof(double)];
+};
 
-    inline bool operator==(const Cell &cell) const {
-        return x == cell.x &&
-               y == cell.y &&
-               z == cell.z;
-    }
+std::vector<ThreadClock> clocks;
+bool ownerSweeps = false; // with -pin, each set is only handled by the thread that built it
+double parallelTime = 0;
+
+template <class Torus, class Counts> void evolve();
+template <class Torus, class Counts> void evolveScatter();
+template <class Torus, bool SCATTER> void evolveOwner();
+template <class Torus, bool SCATTER, class Counts> void evolveTasks();
+template <class Torus> void neighborKeys(const Torus &torus, CellKey cell, int vectorIndex, CellKey neighbors[6], int indexes[6]);
+template <class Torus, class Counts> int getNeighbors(const Torus &torus, CellKey cell, int i, std::vector<CellKey> *stage);
+inline void insertNextGeneration(CellKey cell, int index);
+template <class Counts> void advanceSet(int index);
+inline std::vector<CellKey> *threadStage();
+template <class Counts> void mergeStaged(int index);
+inline void ownedRange(int thread, int nrThreads, int &first, int &last);
+template <class Body> void forEachSet(const Body &body);
+inline void prepareThreads();
+inline void busySince(double start);
+void reportThreads(std::ostream &out);
+void evolveSorted(int nrGenerations);
+inline Fingerprint generationFingerprint();
 
-    inline bool operator<(const Cell &cell) const {
-        return std::tie(x, y, z) < std::tie(cell.x, cell.y, cell.z);
-    }
+inline void initializeVector(std::vector<CellSet> &sets);
+inline void printResults();
 
-    inline friend std::ostream &operator<<(std::ostream &os, const Cell &cell) {
-        os <<  cell.x << " " << cell.y << " " << cell.z;
-        return os;
+// picks the kernel for the torus class of the world size
+struct SelectKernel {
+    typedef void (*Result)();
+    bool scatter;
+    bool owner;
+    bool tasks;
+    bool shared;
+
+    template <class Torus> Result pick() const {
+        if (owner) {
+            return scatter ? evolveOwner<Torus, true> : evolveOwner<Torus, false>;
+        }
+        return shared ? pickCounts<Torus, SharedCounter>() : pickCounts<Torus, DeadMap>();
     }
 
-    struct hash {
-        size_t operator()(Cell const &x) const noexcept
-        {
-            return ((51 + std::hash<int>()(x.getX())) *
-                    (51 + 2*std::hash<int>()(x.getY())) *
-                    (51 + 4*std::hash<int>()(x.getZ()))
-            );
+    template <class Torus, class Counts> Result pickCounts() const {
+        if (tasks) {
+            return scatter ? evolveTasks<Torus, true, Counts> : evolveTasks<Torus, false, Counts>;
         }
-    };
+        return scatter ? evolveScatter<Torus, Counts> : evolve<Torus, Counts>;
+    }
 };
 
-int size;
-int index = 0;
-
-// new data structures
-typedef std::unordered_set<Cell, Cell::hash> CellSet;
-typedef std::unordered_map<Cell, int, Cell::hash> DeadMap;
-
-std::vector<CellSet> currentGeneration(NR_SETS);
-std::vector<CellSet> nextGeneration(NR_SETS);
-std::vector<DeadMap> deadCells(NR_SETS);
-
-void evolve();
-int getNeighbors(Cell cell, int i);
-void insertNextGeneration(Cell cell);
-void insertDeadCell(Cell cell);
-
-inline void initializeVector(std::vector<CellSet> &sets);
-inline void initializeMap(std::vector<DeadMap> &maps);
-inline void printResults();
-
 int main(int argc, char* argv[]) {
 
-    if (argc != ARG_SIZE) {
-        std::cout << "Usage: life3d <filename> <nr of generations>" << std::endl;
+    if (argc < ARG_SIZE) {
+        std::cout << "Usage: life3d <filename> <nr of generations> [-engine sparse|owner|sorted] [-kernel probe|scatter] [-partition slabs|pencils|blocks|morton] [-partitions <n>] [-schedule sets|tasks] [-counts staged|shared] [-pin] [-stats] [-period]" << std::endl;
         return -1;
     }
 
@@ -111,20 +165,213 @@ int main(int argc, char* argv[]) {
     
     std::string filename = argv[1];
     int nrGenerations = std::stoi(argv[2]);
+    std::string engine = "sparse";
+    std::string kernel = "probe";
+    std::string schedule = "sets";
+    std::string counts = "staged";
+    bool reportPeriod = false;
+    bool stats = false;
+    bool pin = false;
+    PartitionScheme scheme = SLABS;
+    int nrPartitions = 0; // derived from the thread count
+
+    for (int i = ARG_SIZE; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "-engine" && i + 1 < argc) {
+            engine = argv[++i];
+        }
+        else if (option == "-kernel" && i + 1 < argc) {
+            kernel = argv[++i];
+        }
+        else if (option == "-partition" && i + 1 < argc) {
+            if (!parsePartitionScheme(argv[++i], scheme)) {
+                std::cout << "Unknown partition scheme: " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (option == "-partitions" && i + 1 < argc) {
+            nrPartitions = std::stoi(argv[++i]);
+        }
+        else if (option == "-schedule" && i + 1 < argc) {
+            schedule = argv[++i];
+        }
+        else if (option == "-counts" && i + 1 < argc) {
+            counts = argv[++i];
+        }
+        else if (option == "-pin") {
+            pin = true;
+        }
+        else if (option == "-stats") {
+            stats = true;
+        }
+        else if (option == "-period") {
+            reportPeriod = true;
+        }
+        else {
+            std::cout << "Unknown option: " << option << std::endl;
+            return -1;
+        }
+    }
+
+    if (engine != "sparse" && engine != "owner" && engine != "sorted") {
+        std::cout << "Unknown engine: " << engine << std::endl;
+        return -1;
+    }
+
+    // the sorted engine keeps no fingerprints and always runs every generation
+    if (reportPeriod && engine == "sorted") {
+        std::cerr << "Engine sorted does not detect cycles; -period is ignored" << std::endl;
+    }
+
+    if (kernel != "probe" && kernel != "scatter") {
+        std::cout << "Unknown kernel: " << kernel << std::endl;
+        return -1;
+    }
+
+    if (schedule != "sets" && schedule != "tasks") {
+        std::cout << "Unknown schedule: " << schedule << std::endl;
+        return -1;
+    }
+
+    if (counts != "staged" && counts != "shared") {
+        std::cout << "Unknown count table: " << counts << std::endl;
+        return -1;
+    }
+    bool shared = counts == "shared";
 
     std::ifstream infile(filename);
     infile >> size;
     int x, y, z;
 
+    if (nrPartitions <= 0) {
+        nrPartitions = derivedPartitions(omp_get_max_threads());
+    }
+    partitions = Partitioning(size, nrPartitions, scheme);
+    nrSets = nrPartitions;
+    currentGeneration.resize(nrSets);
+    nextGeneration.resize(nrSets);
+    deadCells.resize(nrSets);
+    sharedCounts.resize(shared ? nrSets : 0);
+    fingerprints.resize(nrSets);
 
+    std::vector<std::vector<CellKey> > cellsRead(nrSets);
     while (infile >> x >> y >> z) {
-        Cell cell(x, y, z);
-        currentGeneration[cell.getIndex()].insert(cell);
+        cellsRead[partitions.index(x, y, z)].push_back(packCell(x, y, z));
     }
 
+    /*
+     * Each thread builds the tables of the sets it owns in the
+     * owner-computes split (the first touch puts their pages on its
+     * node), after pinning itself with -pin. The thread pool keeps its
+     * threads, and so their pinning, across parallel regions.
+     */
+    std::vector<NodeCounters> countersBefore = nodeCounters();
+    ownerSweeps = pin;
+    std::vector<int> pinnedCpus(omp_get_max_threads(), -1);
+    #pragma omp parallel
+    {
+        int thread = omp_get_thread_num();
+        if (pin) {
+            pinnedCpus[thread] = pinThread(thread);
+        }
 
-    for (int i = 0; i < nrGenerations; i++) {
-        evolve();
+        int first, last;
+        ownedRange(thread, omp_get_num_threads(), first, last);
+        for (int p = first; p < last; p++) {
+            std::vector<CellKey> &cells = cellsRead[p];
+            currentGeneration[p].reserve(cells.size());
+            nextGeneration[p].reserve(cells.size());
+            if (shared) {
+                sharedCounts[p].reserve(cells.size());
+            }
+            else {
+                deadCells[p].reserve(cells.size());
+            }
+            for (size_t c = 0; c < cells.size(); c++) {
+                if (currentGeneration[p].insert(cells[c])) {
+                    fingerprints[p].add(cells[c]);
+                }
+            }
+            std::vector<CellKey>().swap(cells);
+        }
+    }
+
+
+    if (engine == "sorted") {
+        evolveSorted(nrGenerations);
+        return 0;
+    }
+
+    SelectKernel select = { kernel == "scatter", engine == "owner", schedule == "tasks", shared };
+    void (*step)() = selectTorus(size, select);
+    prepareThreads();
+
+    // once a generation repeats, only the position in the cycle matters
+    CycleDetector cycles;
+    cycles.record(generationFingerprint());
+    AllocationStats allocations;
+    allocations.start();
+
+    // throughput: live cells evolved per second
+    double evolveStart = omp_get_wtime();
+    unsigned long long cellsEvolved = nrGenerations > 0 ? generationFingerprint().population : 0;
+    int generationsEvolved = 0;
+    int lastGeneration = nrGenerations; // moved closer once a cycle is found
+    bool cycleFound = false;
+    bool running = nrGenerations > 0;
+
+    /*
+     * One parallel region for the whole run, so the threads are forked
+     * once: every thread runs each generation step, whose loops end in
+     * barriers, and one of them then records the generation while the
+     * others wait at the end of the single.
+     */
+    #pragma omp parallel
+    {
+        while (running) {
+            step();
+
+            #pragma omp single
+            {
+                allocations.generation();
+                generationsEvolved++;
+                Fingerprint fingerprint = generationFingerprint();
+
+                int period = cycleFound ? 0 : cycles.record(fingerprint);
+                if (period > 0) {
+                    if (reportPeriod) {
+                        std::cerr << "period " << period << " detected at generation " << generationsEvolved << std::endl;
+                    }
+                    cycleFound = true;
+                    lastGeneration = generationsEvolved + (nrGenerations - generationsEvolved) % period;
+                }
+
+                running = generationsEvolved < lastGeneration;
+                if (running) {
+                    cellsEvolved += fingerprint.population;
+                }
+            }
+        }
+    }
+    parallelTime = omp_get_wtime() - evolveStart;
+
+    if (stats) {
+        double seconds = parallelTime;
+        std::cerr << omp_get_max_threads() << " threads: " << generationsEvolved << " generations in "
+                  << seconds * 1000 << " ms, " << cellsEvolved / seconds << " live cells/s" << std::endl;
+        allocations.report(std::cerr);
+        reportThreads(std::cerr);
+        for (size_t t = 0; pin && t < pinnedCpus.size(); t++) {
+            std::cerr << "thread " << t << " pinned to cpu " << pinnedCpus[t]
+                      << " (node " << cpuNode(pinnedCpus[t]) << ")" << std::endl;
+        }
+        reportPlacement(std::cerr, countersBefore);
+
+        std::vector<size_t> populations(nrSets);
+        for (int i = 0; i < nrSets; i++) {
+            populations[i] = currentGeneration[i].size();
+        }
+        reportPartitions(std::cerr, scheme, populations);
     }
     
     printResults();
@@ -135,590 +382,485 @@ int main(int argc, char* argv[]) {
     return 0;
 }
 
-inline void initializeMap(std::vector<DeadMap> &maps) {
-    for (int i = 0; i < NR_SETS; i++) {
-        DeadMap map;
-        maps[i] = map;
-    }
+/*
+ * The kernels are generation steps run by every thread of the evolve
+ * parallel region; their loops share out the sets and end in barriers.
+ */
+template <class Torus, class Counts>
+void evolve() {
+    Torus torus(size);
+    std::vector<CellKey> *stage = threadStage();
+
+    // We will divide the current generation vector sets among various threads available (see forEachSet)
+    forEachSet([&](int i) {
+        double start = omp_get_wtime();
+        // Each thread iterates through a set...
+        CellSet &set = currentGeneration[i];
+        fingerprints[i] = Fingerprint();
+
+        for (auto it = set.begin(); it != set.end(); ++it){
+            int neighbors = getNeighbors<Torus, Counts>(torus, *it, i, stage);
+            if (neighbors >= 2 && neighbors <= 4) {
+                // with 2 to 4 neighbors the cell lives
+                insertNextGeneration(*it, i);
+            }
+        }
+        busySince(start);
+    });
+
+    // We will also divide the dead cells map among various threads available
+    forEachSet([&](int i) {
+        double start = omp_get_wtime();
+        // Each thread merges the counts staged for a map, then iterates through it
+        mergeStaged<Counts>(i);
+        Counts &map = countTables<Counts>()[i];
+
+        for (auto it = map.begin(); it != map.end(); ++it){
+            if (it->count == 2 || it->count == 3) {
+                insertNextGeneration(it->key, i);
+            }
+        }
+        advanceSet<Counts>(i);
+        busySince(start);
+    });
 }
 
-inline int generateIndex(int x, int y, int z) {
-    /*
-    return ((51 + std::hash<int>()(x)) *
-            (51 + std::hash<int>()(y)) *
-            (51 + std::hash<int>()(z))) % NR_SETS;*/
+/*
+ * Scatter-count kernel: every live cell adds 1 to the count of each of its
+ * six neighbors and LIVE_MARK to its own, all in deadCells, so there are
+ * no probes of currentGeneration. One sweep over the counts then gives
+ * the next generation: count % LIVE_MARK neighbors, alive if the mark is
+ * there. The neighbor increments are staged; the marks are added by the
+ * owner of each set, straight from currentGeneration.
+ */
+template <class Torus, class Counts>
+void evolveScatter() {
+    Torus torus(size);
+    std::vector<CellKey> *stage = threadStage();
+
+    forEachSet([&](int i) {
+        double start = omp_get_wtime();
+        CellSet &set = currentGeneration[i];
+        CellKey neighbors[6];
+        int indexes[6];
+
+        for (auto it = set.begin(); it != set.end(); ++it){
+            neighborKeys(torus, *it, i, neighbors, indexes);
+            for (int n = 0; n < 6; n++) {
+                countNeighbor<Counts>(stage, indexes[n], neighbors[n]);
+            }
+        }
+        busySince(start);
+    });
+
+    forEachSet([&](int i) {
+        double start = omp_get_wtime();
+        Counts &map = countTables<Counts>()[i];
+        CellSet &set = currentGeneration[i];
+        fingerprints[i] = Fingerprint();
+        for (auto it = set.begin(); it != set.end(); ++it){
+            map.increment(*it, LIVE_MARK);
+        }
+        mergeStaged<Counts>(i);
+
+        for (auto it = map.begin(); it != map.end(); ++it){
+            int neighbors = it->count % LIVE_MARK;
+            bool alive = it->count >= LIVE_MARK;
+            if (neighbors == 2 || neighbors == 3 || (alive && neighbors == 4)) {
+                insertNextGeneration(it->key, i);
+            }
+        }
+        advanceSet<Counts>(i);
+        busySince(start);
+    });
+}
 
-    double nrInChargeX = (double) size / (double) (NR_SETS);
-    double nrInChargeY = (double) size / (double) CHUNK;
-    int index = 0, indexX = 0;
-    int indexY = (int) (y / nrInChargeY);
-    if(size < NR_SETS){
-        indexX = (int) (x / nrInChargeX);
-        index = (indexX + indexY) %((NR_SETS));
-    }else{
-        index = (x * NR_SETS) / size;
+/*
+ * Owner-computes engine: each thread owns a contiguous range of
+ * partitions, a thick slab or a run of blocks, and is the only one to
+ * write their counts and next generation. Count increments for cells of
+ * another thread's region go to the outbox for their partition, and each
+ * owner drains the outboxes addressed to it after the barrier. The probe
+ * and scatter kernels differ as in evolve and evolveScatter.
+ */
+template <class Torus, bool SCATTER>
+void evolveOwner() {
+    Torus torus(size);
+    int first, last;
+    ownedRange(omp_get_thread_num(), omp_get_num_threads(), first, last);
+    double start = omp_get_wtime();
+
+    for (int p = first; p < last; p++) {
+        if (!owners[p]) {
+            // first touch by the owner
+            owners[p].reset(new OwnerState(nrSets));
+        }
+        owners[p]->fingerprint = Fingerprint();
     }
 
+    for (int p = first; p < last; p++) {
+        OwnerState &state = *owners[p];
+        CellSet &set = currentGeneration[p];
+        CellKey neighbors[6];
+        int indexes[6];
 
-    return index;
+        for (auto it = set.begin(); it != set.end(); ++it) {
+            neighborKeys(torus, *it, p, neighbors, indexes);
+            int alive = 0;
+            for (int n = 0; n < 6; n++) {
+                if (!SCATTER && currentGeneration[indexes[n]].contains(neighbors[n])) {
+                    alive++;
+                }
+                else if (indexes[n] >= first && indexes[n] < last) {
+                    owners[indexes[n]]->counts[neighbors[n]] += 1;
+                }
+                else {
+                    state.outbox[indexes[n]].push_back(neighbors[n]);
+                }
+            }
+            if (SCATTER) {
+                state.counts[*it] += LIVE_MARK;
+            }
+            else if (alive >= 2 && alive <= 4) {
+                if (state.next.insert(*it)) {
+                    state.fingerprint.add(*it);
+                }
+            }
+        }
+    }
+
+    busySince(start);
+
+    #pragma omp barrier
+
+    start = omp_get_wtime();
+    for (int p = first; p < last; p++) {
+        OwnerState &state = *owners[p];
+        for (int source = 0; source < nrSets; source++) {
+            std::vector<CellKey> &keys = owners[source]->outbox[p];
+            for (size_t k = 0; k < keys.size(); k++) {
+                state.counts[keys[k]] += 1;
+            }
+            keys.clear();
+        }
+
+        for (auto it = state.counts.begin(); it != state.counts.end(); ++it) {
+            int neighbors = it->count % LIVE_MARK;
+            bool alive = it->count >= LIVE_MARK;
+            bool born = SCATTER ? neighbors == 2 || neighbors == 3 || (alive && neighbors == 4)
+                                : it->count == 2 || it->count == 3;
+            if (born && state.next.insert(it->key)) {
+                state.fingerprint.add(it->key);
+            }
+        }
+        state.counts.clear();
+
+        // hand the generation over and take back the emptied old one
+        currentGeneration[p].clear();
+        std::swap(state.next, currentGeneration[p]);
+        fingerprints[p] = state.fingerprint;
+    }
+    busySince(start);
+
+    // every set is handed over before the generation is recorded and probed
+    #pragma omp barrier
 }
 
-void evolve() {
-    #pragma omp parallel
+/*
+ * Scans the slots [begin, end) of set i, splitting into two tasks while
+ * the range holds more than about TASK_GRAIN live cells, so a set is cut
+ * into pieces in proportion to its population. Idle threads steal the
+ * pieces. Count increments and, for the probe kernel, survivors are
+ * staged by the thread running the piece.
+ */
+template <class Torus, bool SCATTER, class Counts>
+void scanTask(Torus torus, int i, size_t begin, size_t end) {
+    const CellSet &set = currentGeneration[i];
+    size_t estimate = set.size() * (end - begin) / set.capacity();
+    if (estimate > TASK_GRAIN && end - begin > 1) {
+        size_t middle = begin + (end - begin) / 2;
+        #pragma omp task
+        scanTask<Torus, SCATTER, Counts>(torus, i, begin, middle);
+        #pragma omp task
+        scanTask<Torus, SCATTER, Counts>(torus, i, middle, end);
+        return;
+    }
+
+    double start = omp_get_wtime();
+    std::vector<CellKey> *stage = threadStage();
+    std::vector<CellKey> &survivors = stagedSurvivors[(size_t) omp_get_thread_num() * nrSets + i];
+    const CellKey *slots = set.data();
+    CellKey neighbors[6];
+    int indexes[6];
+
+    for (size_t slot = begin; slot < end; slot++) {
+        CellKey cell = slots[slot];
+        if (cell == EMPTY_KEY) {
+            continue;
+        }
+        if (SCATTER) {
+            neighborKeys(torus, cell, i, neighbors, indexes);
+            for (int n = 0; n < 6; n++) {
+                countNeighbor<Counts>(stage, indexes[n], neighbors[n]);
+            }
+        }
+        else {
+            int alive = getNeighbors<Torus, Counts>(torus, cell, i, stage);
+            if (alive >= 2 && alive <= 4) {
+                survivors.push_back(cell);
+            }
+        }
+    }
+    busySince(start);
+}
+
+/*
+ * The sparse kernels with the scan of the live cells run as tasks (see
+ * scanTask) instead of one set per loop iteration, so a dense cluster in
+ * one set is shared by all threads. The merge and sweep stay one set per
+ * iteration, as in evolve and evolveScatter.
+ */
+template <class Torus, bool SCATTER, class Counts>
+void evolveTasks() {
+    Torus torus(size);
+    #pragma omp single
     {
-        // We will divide the current generation vector sets dynamically among various threads available
-        #pragma omp for schedule(dynamic, CHUNK)
-        for (int i = 0; i < NR_SETS; i++) {
-            // Each thread iterates through a set...
-            CellSet &set = currentGeneration[i];
+        for (int i = 0; i < nrSets; i++) {
+            if (currentGeneration[i].size() > 0) {
+                #pragma omp task
+                scanTask<Torus, SCATTER, Counts>(torus, i, 0, currentGeneration[i].capacity());
+            }
+        }
+    }
 
+    forEachSet([&](int i) {
+        double start = omp_get_wtime();
+        Counts &map = countTables<Counts>()[i];
+        fingerprints[i] = Fingerprint();
+        if (SCATTER) {
+            CellSet &set = currentGeneration[i];
             for (auto it = set.begin(); it != set.end(); ++it){
-                int neighbors = getNeighbors(*it, i);
-                if (neighbors >= 2 && neighbors <= 4) {
-                    // with 2 to 4 neighbors the cell lives
-                    insertNextGeneration(*it);
+                map.increment(*it, LIVE_MARK);
+            }
+        }
+        else {
+            for (size_t t = i; t < stagedSurvivors.size(); t += nrSets) {
+                std::vector<CellKey> &survivors = stagedSurvivors[t];
+                for (size_t k = 0; k < survivors.size(); k++) {
+                    insertNextGeneration(survivors[k], i);
                 }
+                survivors.clear();
             }
         }
+        mergeStaged<Counts>(i);
 
-        // We will also divide the dead cells map dynamically among various threads available
-        #pragma omp for schedule(dynamic, CHUNK)
-        for (int i = 0; i < NR_SETS; i++) {
-            // Each thread iterates through a map
-            DeadMap &map = deadCells[i];
-
-            for (auto it = map.begin(); it != map.end(); ++it){
-                if (it->second == 2 || it->second == 3) {
-                    insertNextGeneration(it->first);
-                }
+        for (auto it = map.begin(); it != map.end(); ++it){
+            int neighbors = it->count % LIVE_MARK;
+            bool alive = it->count >= LIVE_MARK;
+            bool born = SCATTER ? neighbors == 2 || neighbors == 3 || (alive && neighbors == 4)
+                                : it->count == 2 || it->count == 3;
+            if (born) {
+                insertNextGeneration(it->key, i);
             }
         }
+
+        advanceSet<Counts>(i);
+        busySince(start);
+    });
+}
+
+/*
+ * Sort-based engine: no hash tables and no critical sections, every pass
+ * is split evenly among the threads (see sortengine.h).
+ */
+void evolveSorted(int nrGenerations) {
+    SortEngine sorted(size);
+    std::vector<CellKey> cells;
+
+    for (int i = 0; i < nrSets; i++) {
+        cells.insert(cells.end(), currentGeneration[i].begin(), currentGeneration[i].end());
     }
+    sorted.load(cells);
 
-    currentGeneration = std::move(nextGeneration); // new generation is our current generation
-    nextGeneration = std::vector<CellSet>(NR_SETS);
-    for (int i = 0; i < NR_SETS; i++) {
-        initializeMap(deadCells); 
+    for (int i = 0; i < nrGenerations; i++) {
+        sorted.evolve();
     }
+
+    cells.clear();
+    sorted.cells(cells);
+    printCells(cells);
 }
 
-int getNeighbors(Cell cell, int vectorIndex) {
-    int nrNeighbors = 0;
-    int x = cell.getX();
-    int y = cell.getY();
-    int z = cell.getZ();
+// the six neighbors of cell and the sets they belong to
+template <class Torus>
+void neighborKeys(const Torus &torus, CellKey cell, int vectorIndex, CellKey neighbors[6], int indexes[6]) {
+    int x = cellX(cell);
+    int y = cellY(cell);
+    int z = cellZ(cell);
     int xx, yy, zz;
 
-    Cell cell1;
-    Cell cell2;
-    Cell cell3;
-    Cell cell4;
-    Cell cell5;
-    Cell cell6;
+    xx = torus.down(x);
+    neighbors[0] = packCell(xx, y, z);
+    indexes[0] = partitions.index(xx, y, z);
 
-    if (x - 1 < 0) {
-        xx = size - 1;
-        cell1 = Cell(xx, y, z);
-    }
-    else {
-        cell1 = Cell(x - 1, y, z);
-    }
+    xx = torus.up(x);
+    neighbors[1] = packCell(xx, y, z);
+    indexes[1] = partitions.index(xx, y, z);
 
-    if (x + 1 >= size) {
-        xx = 0;
-        cell2 = Cell(xx, y, z);
-    }
-    else {
-        cell2 = Cell(x + 1, y, z);
-    }
+    yy = torus.down(y);
+    neighbors[2] = packCell(x, yy, z);
+    indexes[2] = partitions.index(x, yy, z);
 
-    if (y - 1 < 0) {
-        yy = size - 1;
-        cell3 = Cell(x, yy, z);
-    }
-    else {
-        cell3 = Cell(x, y - 1, z);
-    }
+    yy = torus.up(y);
+    neighbors[3] = packCell(x, yy, z);
+    indexes[3] = partitions.index(x, yy, z);
 
-    if (y + 1 >= size) {
-        yy = 0;
-        cell4 = Cell(x, yy, z);
-    }
-    else {
-        cell4 = Cell(x, y + 1, z);
-    }
+    // slabs and pencils leave z out of the partition index
+    zz = torus.down(z);
+    neighbors[4] = packCell(x, y, zz);
+    indexes[4] = partitions.ignoresZ() ? vectorIndex : partitions.index(x, y, zz);
 
-    if (z - 1 < 0) {
-        zz = size - 1;
-        cell5 = Cell(x, y, zz);
-    }
-    else {
-        cell5 = Cell(x, y, z - 1);
-    }
+    zz = torus.up(z);
+    neighbors[5] = packCell(x, y, zz);
+    indexes[5] = partitions.ignoresZ() ? vectorIndex : partitions.index(x, y, zz);
+}
 
-    if (z + 1 >= size) {
-        zz = 0;
-        cell6 = Cell(x, y, zz);
-    }
-    else {
-        cell6 = Cell(x, y, z + 1);
-    }
-    
-    if (currentGeneration[cell1.getIndex()].count(cell1) > 0) {
-        nrNeighbors++;
-    }
-    else {
-        insertDeadCell(cell1);
-    }
-    
-    if (currentGeneration[cell2.getIndex()].count(cell2) > 0) {
-        nrNeighbors++;
-    }
-    else {
-        insertDeadCell(cell2);
-    }
+// counts the live neighbors of cell, counting it for the dead ones (see countNeighbor)
+template <class Torus, class Counts>
+int getNeighbors(const Torus &torus, CellKey cell, int vectorIndex, std::vector<CellKey> *stage) {
+    int nrNeighbors = 0;
+    CellKey neighbors[6];
+    int indexes[6];
 
-    if (currentGeneration[cell3.getIndex()].count(cell3) > 0) {
-        nrNeighbors++;
-    }
-    else {
-        insertDeadCell(cell3);
-    }
+    neighborKeys(torus, cell, vectorIndex, neighbors, indexes);
 
-    if (currentGeneration[cell4.getIndex()].count(cell4) > 0) {
-        nrNeighbors++;
-    }
-    else {
-        insertDeadCell(cell4);
+    for (int i = 0; i < 6; i++) {
+        if (currentGeneration[indexes[i]].contains(neighbors[i])) {
+            nrNeighbors++;
+        }
+        else {
+            countNeighbor<Counts>(stage, indexes[i], neighbors[i]);
+        }
     }
 
-    if (currentGeneration[cell5.getIndex()].count(cell5) > 0) {
-        nrNeighbors++;
-    }
-    else {
-        insertDeadCell(cell5);
-    }
+    return nrNeighbors;
+}
+
+// the staging buffers of the calling thread, one per set
+inline std::vector<CellKey> *threadStage() {
+    return &staged[(size_t) omp_get_thread_num() * nrSets];
+}
+
+// the sets [first, last) of thread in the owner-computes split, a contiguous range
+inline void ownedRange(int thread, int nrThreads, int &first, int &last) {
+    first = (int) ((int64_t) nrSets * thread / nrThreads);
+    last = (int) ((int64_t) nrSets * (thread + 1) / nrThreads);
+}
 
-    if (currentGeneration[cell6.getIndex()].count(cell6) > 0) {
-        nrNeighbors++;
+/*
+ * Runs body(i) for every set, shared among the threads of the region and
+ * ending in a barrier: dynamically, or with ownerSweeps each set by the
+ * thread whose ownedRange built it, so the tables it scans, merges into,
+ * grows and clears stay on that thread's node.
+ */
+template <class Body>
+void forEachSet(const Body &body) {
+    if (ownerSweeps) {
+        int first, last;
+        ownedRange(omp_get_thread_num(), omp_get_num_threads(), first, last);
+        for (int i = first; i < last; i++) {
+            body(i);
+        }
+        #pragma omp barrier
     }
     else {
-        insertDeadCell(cell6);
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < nrSets; i++) {
+            body(i);
+        }
     }
+}
 
-    return nrNeighbors;
+// sizes the per-thread buffers and clocks once, before the evolve parallel region
+inline void prepareThreads() {
+    size_t nrStages = (size_t) omp_get_max_threads() * nrSets;
+    staged.resize(nrStages);
+    stagedSurvivors.resize(nrStages);
+    owners.resize(nrSets);
+    ThreadClock idle = { 0, {} };
+    clocks.resize(omp_get_max_threads(), idle);
 }
 
-void insertNextGeneration(Cell cell) {
-    int index = cell.getIndex();
+// adds the time since start to the calling thread's busy time
+inline void busySince(double start) {
+    clocks[omp_get_thread_num()].busy += omp_get_wtime() - start;
+}
 
-    switch(index){
-        case 0 :
-            #pragma omp critical (nextGeneration_0)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 1 :
-            #pragma omp critical (nextGeneration_1)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 2 :
-            #pragma omp critical (nextGeneration_2)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 3 :
-            #pragma omp critical (nextGeneration_3)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 4 :
-            #pragma omp critical (nextGeneration_4)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 5 :
-            #pragma omp critical (nextGeneration_5)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 6 :
-            #pragma omp critical (nextGeneration_6)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 7 :
-            #pragma omp critical (nextGeneration_7)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 8 :
-            #pragma omp critical (nextGeneration_8)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 9 :
-            #pragma omp critical (nextGeneration_9)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 10 :
-            #pragma omp critical (nextGeneration_10)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 11 :
-            #pragma omp critical (nextGeneration_11)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 12 :
-            #pragma omp critical (nextGeneration_12)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 13 :
-            #pragma omp critical (nextGeneration_13)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 14 :
-            #pragma omp critical (nextGeneration_14)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 15 :
-            #pragma omp critical (nextGeneration_15)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 16 :
-            #pragma omp critical (nextGeneration_16)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 17 :
-            #pragma omp critical (nextGeneration_17)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 18 :
-            #pragma omp critical (nextGeneration_18)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 19 :
-            #pragma omp critical (nextGeneration_19)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 20 :
-            #pragma omp critical (nextGeneration_20)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 21 :
-            #pragma omp critical (nextGeneration_21)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 22 :
-            #pragma omp critical (nextGeneration_22)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 23 :
-            #pragma omp critical (nextGeneration_23)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 24 :
-            #pragma omp critical (nextGeneration_24)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 25 :
-            #pragma omp critical (nextGeneration_25)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 26 :
-            #pragma omp critical (nextGeneration_26)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 27 :
-            #pragma omp critical (nextGeneration_27)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 28 :
-            #pragma omp critical (nextGeneration_28)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 29 :
-            #pragma omp critical (nextGeneration_29)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 30 :
-            #pragma omp critical (nextGeneration_30)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
-        case 31 :
-        #pragma omp critical (nextGeneration_31)
-            {
-                nextGeneration[index].insert(cell);
-            }
-            break;
+void reportThreads(std::ostream &out) {
+    for (size_t t = 0; t < clocks.size(); t++) {
+        double idle = std::max(0.0, parallelTime - clocks[t].busy);
+        out << "thread " << t << ": busy " << clocks[t].busy * 1000 << " ms, idle " << idle * 1000 << " ms ("
+            << (parallelTime > 0 ? 100 * idle / parallelTime : 0) << "%)" << std::endl;
     }
 }
 
-void insertDeadCell(Cell cell) {
-    int index = cell.getIndex();
+/*
+ * Ends the generation of set index once it is complete and nobody probes
+ * the current one: the old tables are emptied, not freed, and the two
+ * generations of the set change places, so the emptied one holds the
+ * generation after next.
+ */
+template <class Counts>
+void advanceSet(int index) {
+    currentGeneration[index].clear();
+    countTables<Counts>()[index].clear();
+    std::swap(currentGeneration[index], nextGeneration[index]);
+}
 
-    switch(index){
-        case 0 :
-            #pragma omp critical (deadCells_0)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 1 :
-            #pragma omp critical (deadCells_1)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 2 :
-            #pragma omp critical (deadCells_2)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 3 :
-            #pragma omp critical (deadCells_3)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 4 :
-            #pragma omp critical (deadCells_4)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 5 :
-            #pragma omp critical (deadCells_5)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 6 :
-            #pragma omp critical (deadCells_6)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 7 :
-            #pragma omp critical (deadCells_7)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 8 :
-            #pragma omp critical (deadCells_8)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 9 :
-            #pragma omp critical (deadCells_9)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 10 :
-            #pragma omp critical (deadCells_10)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 11 :
-            #pragma omp critical (deadCells_11)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 12 :
-            #pragma omp critical (deadCells_12)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 13 :
-            #pragma omp critical (deadCells_13)
-            {
-                deadCells[index][cell] += 1;
-            }
-                break;
-        case 14 :
-            #pragma omp critical (deadCells_14)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 15 :
-            #pragma omp critical (deadCells_15)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 16 :
-            #pragma omp critical (deadCells_16)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 17 :
-            #pragma omp critical (deadCells_17)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 18 :
-            #pragma omp critical (deadCells_18)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 19 :
-            #pragma omp critical (deadCells_19)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 20 :
-            #pragma omp critical (deadCells_20)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 21 :
-            #pragma omp critical (deadCells_21)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 22 :
-            #pragma omp critical (deadCells_22)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 23 :
-            #pragma omp critical (deadCells_23)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 24 :
-            #pragma omp critical (deadCells_24)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 25 :
-        #pragma omp critical (deadCells_25)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 26 :
-            #pragma omp critical (deadCells_26)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 27 :
-            #pragma omp critical (deadCells_27)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 28 :
-            #pragma omp critical (deadCells_28)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 29 :
-            #pragma omp critical (deadCells_29)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 30 :
-            #pragma omp critical (deadCells_30)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
-        case 31 :
-            #pragma omp critical (deadCells_31)
-            {
-                deadCells[index][cell] += 1;
-            }
-            break;
+// only the thread that owns set index adds to it
+inline void insertNextGeneration(CellKey cell, int index) {
+    if (nextGeneration[index].insert(cell)) {
+        fingerprints[index].add(cell);
+    }
+}
+
+/*
+ * Adds 1 to the counts of the keys staged for set index by every thread,
+ * run by the one thread that owns the set; a shared table grows here to
+ * take what it refused. Emptied buffers keep their capacity for the next
+ * generation.
+ */
+template <class Counts>
+void mergeStaged(int index) {
+    Counts &map = countTables<Counts>()[index];
+    for (size_t t = index; t < staged.size(); t += nrSets) {
+        std::vector<CellKey> &keys = staged[t];
+        for (size_t k = 0; k < keys.size(); k++) {
+            map.increment(keys[k], 1);
+        }
+        keys.clear();
     }
 }
 
+// sum of the fingerprints of all sets, built up by insertNextGeneration
+inline Fingerprint generationFingerprint() {
+    Fingerprint fingerprint;
+    for (int i = 0; i < nrSets; i++) {
+        fingerprint.add(fingerprints[i]);
+    }
+    return fingerprint;
+}
+
 /* Aux functions for printing data */
 
 inline void printResults() {
-    std::set<Cell> lastGeneration;
+    std::vector<CellKey> lastGeneration;
 
-    for (int i = 0; i < NR_SETS; i++) { 
-        lastGeneration.insert(currentGeneration[i].begin(),
+    for (int i = 0; i < nrSets; i++) { 
+        lastGeneration.insert(lastGeneration.end(),
+                              currentGeneration[i].begin(),
                               currentGeneration[i].end());
     }
 
-    for (auto it = lastGeneration.begin(); it != lastGeneration.end(); ++it) {
-        std::cout << *it << std::endl;
-    }
+    printCells(lastGeneration);
 }
-
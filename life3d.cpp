@@ -1,110 +1,240 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <set>
-#include <unordered_set>
-#include <unordered_map>
-#include <tuple>
+#include <memory>
+#include <chrono>
+#include <utility>
+#include "cellset.h"
+#include "bitgrid.h"
+#include "sortengine.h"
+#include "hashlife.h"
+#include "bricks.h"
+#include "cycles.h"
+#include "simd.h"
+#include "torus.h"
+#include "rules.h"
+#include "boxgrid.h"
+#include "allocstats.h"
 
 #define ARG_SIZE 3
 
-class Cell
-{
-private:
+// live cells / size^3 at which the adaptive engine switches representation;
+// the gap between them keeps it from flipping back and forth
+#define DENSE_ABOVE 0.003
+#define SPARSE_BELOW 0.001
 
-    int x;
-    int y;
-    int z;
+// live cells the scatter kernel hands to the vector kernels at a time
+#define SCATTER_BATCH 256
 
-public:
+// memory for hashlife nodes and memoized results before they are collected
+#define CACHE_MB 1024
 
-    Cell() {
-    
-    }
+int size;
+int nrGenerations;
+bool stats = false;
+bool reportPeriod = false;
+double denseAbove = DENSE_ABOVE;
+double sparseBelow = SPARSE_BELOW;
+size_t cacheMB = CACHE_MB;
+Rule rule = defaultRule();
+
+CellSet currentGeneration;
+CellSet nextGeneration;
+CellCounter deadCells;
+Fingerprint fingerprint; // of currentGeneration
+
+template <class Torus> void evolve();
+void evolveScatter();
+template <class Torus> void neighborKeys(const Torus &torus, CellKey cell, CellKey neighbors[6]);
+template <class Torus> int getNeighbors(const Torus &torus, CellKey cell);
+void evolveDense();
+void evolveAdaptive();
+void evolveSorted();
+void evolveHashlife();
+void evolveBricks();
+template <class RuleKernel> void evolveRule();
+template <class RuleKernel> void evolveBox();
 
-    Cell(int x, int y, int z) : x(x), y(y), z(z) {
+inline void printResults();
 
-    }
+// picks the kernel for the torus class of the world size; the scatter kernel has one version for all sizes
+struct SelectKernel {
+    typedef void (*Result)();
+    bool scatter;
 
-    inline int getX() const {
-        return x;
+    template <class Torus> Result pick() const {
+        return scatter ? evolveScatter : evolve<Torus>;
     }
+};
 
-    inline int getY() const {
-        return y;
-    }
+// picks the sparse or dense kernel for a rule other than the built-in one
+struct SelectRuleKernel {
+    typedef void (*Result)();
+    bool dense;
 
-    inline int getZ() const {
-        return z;
+    template <class RuleKernel> Result pick() const {
+        return dense ? evolveBox<RuleKernel> : evolveRule<RuleKernel>;
     }
+};
+
+int main(int argc, char* argv[]) {
 
-    inline bool operator!=(Cell const &cell) const { 
-        return !(*this == cell); 
+    if (argc < ARG_SIZE) {
+        std::cout << "Usage: life3d <filename> <nr of generations> [-engine sparse|dense|adaptive|sorted|hashlife|bricks] [-kernel probe|scatter] [-simd scalar|avx2|avx512] [-rule <survive>/<birth>/6|18|26] [-dense-above <ratio>] [-sparse-below <ratio>] [-cache-mb <MB>] [-stats] [-period]" << std::endl;
+        return -1;
     }
 
-    inline bool operator==(const Cell &cell) const {
-        return x == cell.x &&
-               y == cell.y &&
-               z == cell.z;
+    std::string filename = argv[1];
+    nrGenerations = std::stoi(argv[2]);
+    std::string engine = "sparse";
+    std::string kernel = "probe";
+    bool kernelChosen = false;
+
+    for (int i = ARG_SIZE; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "-engine" && i + 1 < argc) {
+            engine = argv[++i];
+        }
+        else if (option == "-kernel" && i + 1 < argc) {
+            kernel = argv[++i];
+            kernelChosen = true;
+        }
+        else if (option == "-simd" && i + 1 < argc) {
+            std::string level = argv[++i];
+            if (!selectSimd(level)) {
+                std::cout << "Unsupported SIMD level: " << level << std::endl;
+                return -1;
+            }
+        }
+        else if (option == "-rule" && i + 1 < argc) {
+            std::string spec = argv[++i];
+            if (!parseRule(spec, rule)) {
+                std::cout << "Invalid rule: " << spec << std::endl;
+                return -1;
+            }
+        }
+        else if (option == "-dense-above" && i + 1 < argc) {
+            denseAbove = std::stod(argv[++i]);
+        }
+        else if (option == "-sparse-below" && i + 1 < argc) {
+            sparseBelow = std::stod(argv[++i]);
+        }
+        else if (option == "-cache-mb" && i + 1 < argc) {
+            cacheMB = std::stoul(argv[++i]);
+        }
+        else if (option == "-stats") {
+            stats = true;
+        }
+        else if (option == "-period") {
+            reportPeriod = true;
+        }
+        else {
+            std::cout << "Unknown option: " << option << std::endl;
+            return -1;
+        }
     }
 
-    inline bool operator<(const Cell &cell) const {
-        return std::tie(x, y, z) < std::tie(cell.x, cell.y, cell.z);
+    if (engine != "sparse" && engine != "dense" && engine != "adaptive" && engine != "sorted" &&
+        engine != "hashlife" && engine != "bricks") {
+        std::cout << "Unknown engine: " << engine << std::endl;
+        return -1;
     }
 
-    inline friend std::ostream &operator<<(std::ostream &os, const Cell &cell) {
-        os <<  cell.x << " " << cell.y << " " << cell.z;
-        return os;
+    if (kernel != "probe" && kernel != "scatter") {
+        std::cout << "Unknown kernel: " << kernel << std::endl;
+        return -1;
     }
 
-    struct hash {
-        size_t operator()(Cell const &x) const noexcept
-        {
-            return ((51 + std::hash<int>()(x.getX())) *
-                    (51 + std::hash<int>()(x.getY())) *
-                    (51 + std::hash<int>()(x.getZ()))
-            );
-        }
-    };
-};
+    // only the sparse engine fingerprints its generations; the others always run all of them
+    if (reportPeriod && engine != "sparse") {
+        std::cerr << "Engine " << engine << " does not detect cycles; -period is ignored" << std::endl;
+    }
 
-int size;
-int nrGenerations;
+    // the other engines have kernels of their own (adaptive steps with the probe kernel)
+    if (kernelChosen && engine != "sparse") {
+        std::cerr << "Engine " << engine << " has no kernel choice; -kernel is ignored" << std::endl;
+    }
 
-std::unordered_set<Cell, Cell::hash> currentGeneration;
-std::unordered_set<Cell, Cell::hash> nextGeneration;
-std::unordered_map<Cell, int, Cell::hash> deadCells;
+    std::ifstream infile(filename);
+    infile >> size;
+ 
+    int x, y, z;
 
-void evolve();
-int getNeighbors(Cell cell);
+    while (infile >> x >> y >> z) {
+        if (currentGeneration.insert(packCell(x, y, z))) {
+            fingerprint.add(packCell(x, y, z));
+        }
+    }
 
-inline void printResults();
-inline void printCells(std::vector<Cell> &cells);
-inline void printCells(std::unordered_set<Cell, Cell::hash> &cells);
-inline void printCells(std::unordered_map<Cell, int, Cell::hash> &cells);
+    bool customRule = !(rule == defaultRule());
+    if (customRule && kernelChosen) {
+        std::cout << "A custom rule has a single kernel; -kernel only applies to the built-in rule" << std::endl;
+        return -1;
+    }
+    if (customRule && engine == "dense") {
+        SelectRuleKernel select = { true };
+        selectRule(rule, select)();
+        return 0;
+    }
+    else if (customRule && engine != "sparse") {
+        std::cout << "Engine " << engine << " only runs the built-in rule" << std::endl;
+        return -1;
+    }
 
-int main(int argc, char* argv[]) {
+    if (engine == "dense") {
+        evolveDense();
+        return 0;
+    }
+    else if (engine == "adaptive") {
+        evolveAdaptive();
+        return 0;
+    }
+    else if (engine == "sorted") {
+        evolveSorted();
+        return 0;
+    }
+    else if (engine == "hashlife") {
+        evolveHashlife();
+        return 0;
+    }
+    else if (engine == "bricks") {
+        evolveBricks();
+        return 0;
+    }
 
-    if (argc != ARG_SIZE) {
-        std::cout << "Usage: life3d <filename> <nr of generations>" << std::endl;
-        return -1;
+    SelectKernel select = { kernel == "scatter" };
+    void (*step)() = selectTorus(size, select);
+    if (customRule) {
+        SelectRuleKernel selectSparse = { false };
+        step = selectRule(rule, selectSparse);
     }
 
-    std::string filename = argv[1];
-    nrGenerations = std::stoi(argv[2]);
+    // once a generation repeats, only the position in the cycle matters
+    CycleDetector cycles;
+    cycles.record(fingerprint);
+    AllocationStats allocations;
+    allocations.start();
 
-    std::ifstream infile(filename);
-    infile >> size;
- 
-    int x, y, z;
+    for (int i = 1; i <= nrGenerations; i++) {
+        step();
+        allocations.generation();
 
-    while (infile >> x >> y >> z) {
-        Cell cell(x, y, z);
-        currentGeneration.insert(cell);
+        int period = cycles.record(fingerprint);
+        if (period > 0) {
+            if (reportPeriod) {
+                std::cerr << "period " << period << " detected at generation " << i << std::endl;
+            }
+            int remaining = (nrGenerations - i) % period;
+            for (int j = 0; j < remaining; j++) {
+                step();
+                allocations.generation();
+            }
+            break;
+        }
     }
 
-    for (int i = 0; i < nrGenerations; i++) {
-        evolve();
+    if (stats) {
+        allocations.report(std::cerr);
     }
 
     printResults();
@@ -112,140 +242,324 @@ int main(int argc, char* argv[]) {
     return 0;
 }
 
+template <class Torus>
 void evolve() {
+    Torus torus(size);
+    fingerprint = Fingerprint();
 
     for (auto it = currentGeneration.begin(); it != currentGeneration.end(); ++it) {
-        int neighbors = getNeighbors(*it);
+        int neighbors = getNeighbors(torus, *it);
         
         if (neighbors >= 2 && neighbors <= 4) {
             // with 2 to 4 neighbors the cell lives 
             nextGeneration.insert(*it);
+            fingerprint.add(*it);
         }
     } 
 
     for (auto it = deadCells.begin(); it != deadCells.end(); ++it) {
-        if (it->second == 2 || it->second == 3) {
-            nextGeneration.insert(it->first);
+        if (it->count == 2 || it->count == 3) {
+            nextGeneration.insert(it->key);
+            fingerprint.add(it->key);
         }
     }
 
-    currentGeneration = nextGeneration; // new generation is our current generation
-    nextGeneration = {}; // clears new generation
+    // double buffer: the old generation's table is reused, capacity and all
+    std::swap(currentGeneration, nextGeneration); // new generation is our current generation
+    nextGeneration.clear(); // clears new generation
     deadCells.clear(); // clears dead cells from previous generation
 }
 
-int getNeighbors(Cell cell) {
-    int nrNeighbors = 0;
-    int x = cell.getX();
-    int y = cell.getY();
-    int z = cell.getZ();
-    int xx, yy, zz;
-
-    Cell cell1;
-    Cell cell2;
-    Cell cell3;
-    Cell cell4;
-    Cell cell5;
-    Cell cell6;
+/*
+ * Scatter-count kernel: every live cell adds 1 to the count of each of its
+ * six neighbors and LIVE_MARK to its own, all in deadCells, so there are
+ * no probes of currentGeneration. One sweep over the counts then gives
+ * the next generation: count % LIVE_MARK neighbors, alive if the mark is
+ * there.
+ *
+ * Neighbor keys and their hashes are made SCATTER_BATCH cells at a time,
+ * and the sweep evaluates the rule over whole runs of table slots, with
+ * the vector kernels of simd.h.
+ */
+void evolveScatter() {
+    static CellKey cells[SCATTER_BATCH];
+    static CellKey neighbors[6 * SCATTER_BATCH];
+    static uint64_t hashes[6 * SCATTER_BATCH];
+
+    fingerprint = Fingerprint();
+    auto it = currentGeneration.begin();
+
+    while (it != currentGeneration.end()) {
+        size_t n = 0;
+        for (; n < SCATTER_BATCH && it != currentGeneration.end(); ++it) {
+            cells[n++] = *it;
+        }
 
-    // x varies
-    if (x - 1 < 0) {
-        xx = size - 1;
-        cell1 = Cell(xx, y, z);
-    }
-    else {
-        cell1 = Cell(x - 1, y, z);
+        batchNeighborKeys(cells, n, size, neighbors);
+        mixKeys(neighbors, 6 * n, hashes);
+        for (size_t i = 0; i < 6 * n; i++) {
+            deadCells.at(neighbors[i], hashes[i]) += 1;
+        }
+        for (size_t i = 0; i < n; i++) {
+            deadCells[cells[i]] += LIVE_MARK;
+        }
     }
 
-    if (x + 1 >= size) {
-        xx = 0;
-        cell2 = Cell(xx, y, z);
-    }
-    else {
-        cell2 = Cell(x + 1, y, z);
+    const CellCounter::Entry *slots = deadCells.data();
+    for (size_t begin = 0; begin < deadCells.capacity(); begin += 6 * SCATTER_BATCH) {
+        size_t count = std::min((size_t) 6 * SCATTER_BATCH, deadCells.capacity() - begin);
+        size_t alive = selectAlive(slots + begin, count, neighbors);
+        for (size_t i = 0; i < alive; i++) {
+            nextGeneration.insert(neighbors[i]);
+            fingerprint.add(neighbors[i]);
+        }
     }
 
-    // y varies
-    if (y - 1 < 0) {
-        yy = size - 1;
-        cell3 = Cell(x, yy, z);
-    }
-    else {
-        cell3 = Cell(x, y - 1, z);
-    }
+    std::swap(currentGeneration, nextGeneration);
+    nextGeneration.clear();
+    deadCells.clear();
+}
 
-    if (y + 1 >= size) {
-        yy = 0;
-        cell4 = Cell(x, yy, z);
-    }
-    else {
-        cell4 = Cell(x, y + 1, z);
-    }
+template <class Torus>
+void neighborKeys(const Torus &torus, CellKey cell, CellKey neighbors[6]) {
+    int x = cellX(cell);
+    int y = cellY(cell);
+    int z = cellZ(cell);
+
+    // x varies
+    neighbors[0] = packCell(torus.down(x), y, z);
+    neighbors[1] = packCell(torus.up(x), y, z);
+
+    // y varies
+    neighbors[2] = packCell(x, torus.down(y), z);
+    neighbors[3] = packCell(x, torus.up(y), z);
 
     // z varies
-    if (z - 1 < 0) {
-        zz = size - 1;
-        cell5 = Cell(x, y, zz);
-    }
-    else {
-        cell5 = Cell(x, y, z - 1);
+    neighbors[4] = packCell(x, y, torus.down(z));
+    neighbors[5] = packCell(x, y, torus.up(z));
+}
+
+template <class Torus>
+int getNeighbors(const Torus &torus, CellKey cell) {
+    int nrNeighbors = 0;
+    CellKey neighbors[6];
+
+    neighborKeys(torus, cell, neighbors);
+
+    for (int i = 0; i < 6; i++) {
+        if (currentGeneration.contains(neighbors[i])) {
+            nrNeighbors++;
+        }
+        else {
+            deadCells[neighbors[i]] += 1;
+        }
     }
 
-    if (z + 1 >= size) {
-        zz = 0;
-        cell6 = Cell(x, y, zz);
+    return nrNeighbors;
+}
+
+/*
+ * Scatter kernel for any rule: live cells add 1 to the count of every
+ * cell of their neighborhood and RULE_LIVE_MARK to their own, and the
+ * rule class turns each count into the next state.
+ */
+template <class RuleKernel>
+void evolveRule() {
+    RuleKernel kernel(rule);
+    int offsets[MAX_NEIGHBORS][3];
+    int nrOffsets = neighborOffsets(kernel.neighborhood(), offsets);
+    fingerprint = Fingerprint();
+
+    for (auto it = currentGeneration.begin(); it != currentGeneration.end(); ++it) {
+        int x = cellX(*it), y = cellY(*it), z = cellZ(*it);
+        // coordinate - 1, coordinate and coordinate + 1 on the torus
+        int xs[3] = { x - 1 < 0 ? size - 1 : x - 1, x, x + 1 >= size ? 0 : x + 1 };
+        int ys[3] = { y - 1 < 0 ? size - 1 : y - 1, y, y + 1 >= size ? 0 : y + 1 };
+        int zs[3] = { z - 1 < 0 ? size - 1 : z - 1, z, z + 1 >= size ? 0 : z + 1 };
+
+        for (int i = 0; i < nrOffsets; i++) {
+            deadCells[packCell(xs[offsets[i][0] + 1], ys[offsets[i][1] + 1], zs[offsets[i][2] + 1])] += 1;
+        }
+        deadCells[*it] += RULE_LIVE_MARK;
     }
-    else {
-        cell6 = Cell(x, y, z + 1);
+
+    for (auto it = deadCells.begin(); it != deadCells.end(); ++it) {
+        if (kernel.next(it->count >= RULE_LIVE_MARK, it->count % RULE_LIVE_MARK)) {
+            nextGeneration.insert(it->key);
+            fingerprint.add(it->key);
+        }
     }
 
-    if (currentGeneration.count(cell1) > 0) {
-        nrNeighbors++;
+    std::swap(currentGeneration, nextGeneration);
+    nextGeneration.clear();
+    deadCells.clear();
+}
+
+/*
+ * Runs every generation on a bit-packed copy of the whole world, which
+ * beats hashing once a few percent of the cells are alive.
+ */
+void evolveDense() {
+    BitGrid grid(size);
+    grid.load(currentGeneration);
+
+    for (int i = 0; i < nrGenerations; i++) {
+        grid.evolve();
     }
-    else {
-        deadCells[cell1] += 1;
+
+    std::vector<CellKey> lastGeneration;
+    grid.cells(lastGeneration);
+    printCells(lastGeneration);
+}
+
+/*
+ * Dense engine for any rule, counting neighbors with box sums (see
+ * boxgrid.h).
+ */
+template <class RuleKernel>
+void evolveBox() {
+    RuleKernel kernel(rule);
+    BoxGrid grid(size);
+    grid.load(currentGeneration);
+
+    for (int i = 0; i < nrGenerations; i++) {
+        grid.evolve(kernel);
     }
-    if (currentGeneration.count(cell2) > 0) {
-        nrNeighbors++;
+
+    std::vector<CellKey> lastGeneration;
+    grid.cells(lastGeneration);
+    printCells(lastGeneration);
+}
+
+/*
+ * Picks the sparse or the dense engine every generation from the fraction
+ * of the world that is alive, converting the world when it crosses
+ * denseAbove (going up) or sparseBelow (going down). With -stats, the
+ * choice of each generation and the time spent converting go to stderr.
+ */
+void evolveAdaptive() {
+    typedef std::chrono::steady_clock Clock;
+
+    double volume = (double) size * size * size;
+    std::unique_ptr<BitGrid> grid; // allocated on the first switch to dense
+    bool dense = false;
+    int nrConversions = 0;
+    double conversionTime = 0;
+
+    SelectKernel select = { false };
+    void (*evolveSparse)() = selectTorus(size, select);
+
+    for (int i = 0; i < nrGenerations; i++) {
+        size_t population = dense ? grid->population() : currentGeneration.size();
+        double density = population / volume;
+
+        if (dense != (dense ? density >= sparseBelow : density > denseAbove)) {
+            Clock::time_point start = Clock::now();
+            if (dense) {
+                grid->store(currentGeneration);
+            }
+            else {
+                if (!grid) {
+                    grid.reset(new BitGrid(size));
+                }
+                grid->load(currentGeneration);
+            }
+            dense = !dense;
+            double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+            conversionTime += elapsed;
+            nrConversions++;
+
+            if (stats) {
+                std::cerr << "generation " << i << ": converted to " << (dense ? "dense" : "sparse")
+                          << " in " << elapsed * 1000 << " ms" << std::endl;
+            }
+        }
+
+        if (stats) {
+            std::cerr << "generation " << i << ": " << population << " cells, density " << density
+                      << ", " << (dense ? "dense" : "sparse") << std::endl;
+        }
+
+        if (dense) {
+            grid->evolve();
+        }
+        else {
+            evolveSparse();
+        }
     }
-    else {
-        deadCells[cell2] += 1;
+
+    if (stats) {
+        std::cerr << nrConversions << " conversions, " << conversionTime * 1000 << " ms total" << std::endl;
     }
-    if (currentGeneration.count(cell3) > 0) {
-        nrNeighbors++;  
+
+    if (dense) {
+        std::vector<CellKey> lastGeneration;
+        grid->cells(lastGeneration);
+        printCells(lastGeneration);
     }
     else {
-        deadCells[cell3] += 1;
-    }
-    if (currentGeneration.count(cell4) > 0) {
-        nrNeighbors++;
+        printResults();
     }
-    else {
-        deadCells[cell4] += 1;
+}
+
+void evolveSorted() {
+    SortEngine sorted(size);
+    std::vector<CellKey> cells(currentGeneration.begin(), currentGeneration.end());
+    sorted.load(cells);
+
+    for (int i = 0; i < nrGenerations; i++) {
+        sorted.evolve();
     }
-    if (currentGeneration.count(cell5) > 0) {
-        nrNeighbors++;
+
+    cells.clear();
+    sorted.cells(cells);
+    printCells(cells);
+}
+
+/*
+ * Memoized octree engine: worlds that settle into regular structures are
+ * advanced many generations per step (see hashlife.h).
+ */
+void evolveHashlife() {
+    Hashlife hashlife(size, cacheMB << 20);
+    std::vector<CellKey> cells(currentGeneration.begin(), currentGeneration.end());
+    hashlife.load(cells);
+    hashlife.advance(nrGenerations);
+
+    if (stats) {
+        hashlife.report(std::cerr);
     }
-    else {
-        deadCells[cell5] += 1;
+
+    cells.clear();
+    hashlife.cells(cells);
+    printCells(cells);
+}
+
+/*
+ * Block-sparse engine: only the 8x8x8 bricks holding live cells and their
+ * face neighbors are evaluated (see bricks.h).
+ */
+void evolveBricks() {
+    BrickEngine bricks(size);
+    std::vector<CellKey> cells(currentGeneration.begin(), currentGeneration.end());
+    bricks.load(cells);
+
+    for (int i = 0; i < nrGenerations; i++) {
+        bricks.evolve();
     }
-    if (currentGeneration.count(cell6) > 0) {
-        nrNeighbors++;
+
+    if (stats) {
+        bricks.report(std::cerr);
     }
-    else {
-        deadCells[cell6] += 1;
-    } 
 
-    return nrNeighbors;
+    cells.clear();
+    bricks.cells(cells);
+    printCells(cells);
 }
 
 /* Aux functions for printing data */
 
 inline void printResults() {
-    std::set<Cell> lastGeneration(currentGeneration.begin(), currentGeneration.end());
-
-    for (auto it = lastGeneration.begin(); it != lastGeneration.end(); ++it) {
-        std::cout << *it << std::endl;
-    }
+    std::vector<CellKey> lastGeneration(currentGeneration.begin(), currentGeneration.end());
+    printCells(lastGeneration);
 }
-
@@ -0,0 +1,199 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <ostream>
+
+// partitions per thread when the count is derived, so dynamic scheduling has room to balance
+#define PARTS_PER_THREAD 4
+// fewest partitions derived, which keeps each set's tables cache-sized
+#define MIN_PARTS 32
+#define HISTOGRAM_BINS 10
+#define HISTOGRAM_WIDTH 50
+
+enum PartitionScheme {
+    SLABS,   // ranges of x
+    PENCILS, // a grid of x and y ranges
+    BLOCKS,  // a grid of x, y and z ranges
+    MORTON   // ranges of the Morton (z-order) curve over a coarse grid
+};
+
+inline bool parsePartitionScheme(const std::string &name, PartitionScheme &scheme) {
+    if (name == "slabs") {
+        scheme = SLABS;
+    }
+    else if (name == "pencils") {
+        scheme = PENCILS;
+    }
+    else if (name == "blocks") {
+        scheme = BLOCKS;
+    }
+    else if (name == "morton") {
+        scheme = MORTON;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Maps a cell to one of nrParts partitions of the size^3 world. All
+ * schemes reduce to per-axis tables: the index is
+ * ((alongX[x] + alongY[y] + alongZ[z]) * scale) >> shift, where the grid
+ * schemes keep scale 1 and shift 0, and the Morton scheme stores the
+ * interleaved coarse bits of each coordinate and scales the code down to
+ * a partition.
+ */
+class Partitioning
+{
+private:
+
+    int nrParts;
+    PartitionScheme partitionScheme;
+    std::vector<uint32_t> alongX, alongY, alongZ;
+    uint64_t scale;
+    int shift;
+
+    // fills table with (c * nrRanges / size) * stride
+    static void ranges(std::vector<uint32_t> &table, int size, int nrRanges, int stride) {
+        table.resize(size);
+        for (int c = 0; c < size; c++) {
+            table[c] = (uint32_t) (((int64_t) c * nrRanges / size) * stride);
+        }
+    }
+
+    // the bits of c spread three apart, starting at bit offset
+    static uint32_t spreadBits(uint32_t c, int bits, int offset) {
+        uint32_t spread = 0;
+        for (int b = 0; b < bits; b++) {
+            spread |= ((c >> b) & 1) << (3 * b + offset);
+        }
+        return spread;
+    }
+
+    // the largest factor of n not above its root-th root, so the grid is close to cubic
+    static int factorNear(int n, int root) {
+        int best = 1;
+        for (int f = 1; f <= n; f++) {
+            int64_t power = 1;
+            for (int r = 0; r < root; r++) {
+                power *= f;
+            }
+            if (power > n) {
+                break;
+            }
+            if (n % f == 0) {
+                best = f;
+            }
+        }
+        return best;
+    }
+
+public:
+
+    Partitioning() : nrParts(1), partitionScheme(SLABS), scale(1), shift(0) {
+
+    }
+
+    Partitioning(int size, int nrParts, PartitionScheme scheme) : nrParts(nrParts), partitionScheme(scheme),
+                                                                  scale(1), shift(0) {
+        alongX.assign(size, 0);
+        alongY.assign(size, 0);
+        alongZ.assign(size, 0);
+
+        if (scheme == SLABS) {
+            ranges(alongX, size, nrParts, 1);
+        }
+        else if (scheme == PENCILS) {
+            int ny = factorNear(nrParts, 2);
+            ranges(alongX, size, nrParts / ny, ny);
+            ranges(alongY, size, ny, 1);
+        }
+        else if (scheme == BLOCKS) {
+            int nz = factorNear(nrParts, 3);
+            int ny = factorNear(nrParts / nz, 2);
+            ranges(alongX, size, nrParts / (ny * nz), ny * nz);
+            ranges(alongY, size, ny, nz);
+            ranges(alongZ, size, nz, 1);
+        }
+        else {
+            // a coarse grid of 2^bits per side with about 8 curve cells per partition
+            int bits = 0;
+            while (bits < 10 && (1 << bits) < size && ((int64_t) 1 << (3 * bits)) < 8 * (int64_t) nrParts) {
+                bits++;
+            }
+            std::vector<uint32_t> coarse;
+            ranges(coarse, size, 1 << bits, 1);
+            for (int c = 0; c < size; c++) {
+                alongX[c] = spreadBits(coarse[c], bits, 2);
+                alongY[c] = spreadBits(coarse[c], bits, 1);
+                alongZ[c] = spreadBits(coarse[c], bits, 0);
+            }
+            scale = nrParts;
+            shift = 3 * bits;
+        }
+    }
+
+    inline int index(int x, int y, int z) const {
+        return (int) (((uint64_t) (alongX[x] + alongY[y] + alongZ[z]) * scale) >> shift);
+    }
+
+    // true when z never changes the partition, so z neighbors share their cell's
+    inline bool ignoresZ() const {
+        return partitionScheme == SLABS || partitionScheme == PENCILS;
+    }
+
+    inline int count() const {
+        return nrParts;
+    }
+
+    inline PartitionScheme scheme() const {
+        return partitionScheme;
+    }
+};
+
+// the partition count for a thread count
+inline int derivedPartitions(int nrThreads) {
+    return std::max(MIN_PARTS, PARTS_PER_THREAD * nrThreads);
+}
+
+inline const char *partitionName(PartitionScheme scheme) {
+    static const char *names[] = { "slabs", "pencils", "blocks", "morton" };
+    return names[scheme];
+}
+
+/*
+ * Prints the live cells per partition as a histogram: how many partitions
+ * fall in each population range, plus the max / mean imbalance.
+ */
+inline void reportPartitions(std::ostream &out, PartitionScheme scheme, const std::vector<size_t> &populations) {
+    size_t total = 0, smallest = populations[0], largest = populations[0];
+    for (size_t i = 0; i < populations.size(); i++) {
+        total += populations[i];
+        smallest = std::min(smallest, populations[i]);
+        largest = std::max(largest, populations[i]);
+    }
+    double mean = (double) total / populations.size();
+
+    out << populations.size() << " " << partitionName(scheme) << " partitions: live cells min " << smallest
+        << ", mean " << mean << ", max " << largest << ", imbalance " << (mean > 0 ? largest / mean : 1.0) << std::endl;
+
+    std::vector<int> bins(HISTOGRAM_BINS, 0);
+    for (size_t i = 0; i < populations.size(); i++) {
+        int bin = largest == 0 ? 0 : (int) (populations[i] * HISTOGRAM_BINS / (largest + 1));
+        bins[bin]++;
+    }
+    int tallest = *std::max_element(bins.begin(), bins.end());
+    for (int b = 0; b < HISTOGRAM_BINS; b++) {
+        size_t low = (largest + 1) * b / HISTOGRAM_BINS;
+        size_t high = (largest + 1) * (b + 1) / HISTOGRAM_BINS;
+        out << "  " << low << "-" << high << ": " << bins[b] << "\t"
+            << std::string(bins[b] * HISTOGRAM_WIDTH / tallest, '#') << std::endl;
+    }
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <ostream>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+/*
+ * Thread pinning and NUMA memory reports, from the Linux interfaces
+ * directly (sched_setaffinity, /proc and /sys), so no libnuma is needed.
+ * Memory is placed by first touch: a pinned thread that allocates and
+ * fills a table gets its pages on its own node. Elsewhere pinning does
+ * nothing and the reports are empty.
+ */
+
+#define MAX_NODES 64
+
+/*
+ * Pins the calling thread to the slot-th CPU the process may run on,
+ * wrapping around, and returns that CPU or -1.
+ */
+inline int pinThread(int slot) {
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return -1;
+    }
+    int target = slot % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            return sched_setaffinity(0, sizeof(one), &one) == 0 ? cpu : -1;
+        }
+    }
+    return -1;
+#else
+    (void) slot;
+    return -1;
+#endif
+}
+
+// the NUMA node of cpu, or 0 when unknown
+inline int cpuNode(int cpu) {
+    for (int node = 0; node < MAX_NODES && cpu >= 0; node++) {
+        std::ifstream list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string ranges;
+        if (!(list >> ranges)) {
+            continue;
+        }
+        std::stringstream in(ranges);
+        std::string range;
+        while (std::getline(in, range, ',')) {
+            int first = 0, last = 0;
+            int fields = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (fields == 1) {
+                last = first;
+            }
+            if (fields >= 1 && cpu >= first && cpu <= last) {
+                return node;
+            }
+        }
+    }
+    return 0;
+}
+
+// kB of this process resident on each node, from /proc/self/numa_maps
+inline std::vector<size_t> nodeMemory() {
+    std::vector<size_t> kB;
+    std::ifstream maps("/proc/self/numa_maps");
+    std::string line;
+    while (std::getline(maps, line)) {
+        std::stringstream in(line);
+        std::string field;
+        size_t pageKB = 4;
+        std::vector<std::pair<int, size_t> > pages;
+        while (in >> field) {
+            int node;
+            size_t count;
+            if (std::sscanf(field.c_str(), "N%d=%zu", &node, &count) == 2 && node >= 0 && node < MAX_NODES) {
+                pages.push_back(std::make_pair(node, count));
+            }
+            else if (field.compare(0, 18, "kernelpagesize_kB=") == 0) {
+                pageKB = std::stoul(field.substr(18));
+            }
+        }
+        for (size_t i = 0; i < pages.size(); i++) {
+            if ((size_t) pages[i].first >= kB.size()) {
+                kB.resize(pages[i].first + 1, 0);
+            }
+            kB[pages[i].first] += pages[i].second * pageKB;
+        }
+    }
+    return kB;
+}
+
+/*
+ * System-wide page allocation counters of a node from its numastat:
+ * pages placed on the node for a task running there (local) or on
+ * another node (other). Only differences over a run mean anything.
+ */
+struct NodeCounters {
+    unsigned long long local;
+    unsigned long long other;
+};
+
+inline std::vector<NodeCounters> nodeCounters() {
+    std::vector<NodeCounters> counters;
+    for (int node = 0; node < MAX_NODES; node++) {
+        std::ifstream stat("/sys/devices/system/node/node" + std::to_string(node) + "/numastat");
+        if (!stat) {
+            break;
+        }
+        NodeCounters counter = { 0, 0 };
+        std::string name;
+        unsigned long long value;
+        while (stat >> name >> value) {
+            if (name == "local_node") {
+                counter.local = value;
+            }
+            else if (name == "other_node") {
+                counter.other = value;
+            }
+        }
+        counters.push_back(counter);
+    }
+    return counters;
+}
+
+// per-node memory of this process and the node counters since before
+inline void reportPlacement(std::ostream &out, const std::vector<NodeCounters> &before) {
+    std::vector<size_t> kB = nodeMemory();
+    std::vector<NodeCounters> after = nodeCounters();
+    size_t nrNodes = std::max(kB.size(), after.size());
+    for (size_t node = 0; node < nrNodes; node++) {
+        out << "node " << node << ": " << (node < kB.size() ? kB[node] / 1024.0 : 0) << " MB";
+        if (node < after.size() && node < before.size()) {
+            out << ", pages placed " << after[node].local - before[node].local << " local, "
+                << after[node].other - before[node].other << " remote (system-wide)";
+        }
+        out << std::endl;
+    }
+}
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <cstdint>
+#include <string>
+#include <sstream>
+
+#define MAX_NEIGHBORS 26
+
+// added to a live cell's own count in rule count tables, above any count
+#define RULE_LIVE_MARK 32
+
+/*
+ * A rule set: bit n of survive is set when a live cell with n live
+ * neighbors stays alive, bit n of birth when a dead one comes alive.
+ * The neighborhood is 6 (faces), 18 (faces and edges) or 26 (the whole
+ * 3x3x3 cube around the cell).
+ */
+struct Rule {
+    uint32_t survive;
+    uint32_t birth;
+    int neighborhood;
+};
+
+// count bits first..last
+constexpr uint32_t countRange(int first, int last) {
+    return first > last ? 0 : (1u << first) | countRange(first + 1, last);
+}
+
+// next-state lookup table of a rule in one word, birth bits in the low half
+constexpr uint64_t ruleTable(uint32_t survive, uint32_t birth) {
+    return ((uint64_t) survive << 32) | birth;
+}
+
+constexpr bool nextState(uint64_t table, bool alive, int count) {
+    return (table >> ((alive ? 32 : 0) + count)) & 1;
+}
+
+#define DEFAULT_SURVIVE countRange(2, 4)
+#define DEFAULT_BIRTH countRange(2, 3)
+
+inline Rule defaultRule() {
+    Rule rule = { DEFAULT_SURVIVE, DEFAULT_BIRTH, 6 };
+    return rule;
+}
+
+inline bool operator==(const Rule &a, const Rule &b) {
+    return a.survive == b.survive && a.birth == b.birth && a.neighborhood == b.neighborhood;
+}
+
+/*
+ * Kernels are templates on a rule class. StaticRule bakes the table into
+ * the instantiation, so the next state of the common rules folds into a
+ * couple of instructions; DynamicRule is the table-driven path for any
+ * other rule.
+ */
+
+template <uint32_t SURVIVE, uint32_t BIRTH, int NEIGHBORHOOD>
+struct StaticRule {
+    explicit StaticRule(const Rule &) {
+
+    }
+
+    inline int neighborhood() const {
+        return NEIGHBORHOOD;
+    }
+
+    inline bool next(bool alive, int count) const {
+        return nextState(ruleTable(SURVIVE, BIRTH), alive, count);
+    }
+};
+
+struct DynamicRule {
+    uint64_t table;
+    int nrNeighbors;
+
+    explicit DynamicRule(const Rule &rule) : table(ruleTable(rule.survive, rule.birth)),
+                                             nrNeighbors(rule.neighborhood) {
+
+    }
+
+    inline int neighborhood() const {
+        return nrNeighbors;
+    }
+
+    inline bool next(bool alive, int count) const {
+        return nextState(table, alive, count);
+    }
+};
+
+// the built-in rule and Bays' 4555 and 5766 rules on the 26 neighborhood
+typedef StaticRule<DEFAULT_SURVIVE, DEFAULT_BIRTH, 6> DefaultRule;
+typedef StaticRule<countRange(4, 5), countRange(5, 5), 26> Rule4555;
+typedef StaticRule<countRange(5, 7), countRange(6, 6), 26> Rule5766;
+
+/*
+ * Returns select.pick<RuleKernel>() for rule: a StaticRule instantiation
+ * for the common rules, DynamicRule for the rest.
+ */
+template <class Select>
+typename Select::Result selectRule(const Rule &rule, const Select &select) {
+    Rule rule4555 = { countRange(4, 5), countRange(5, 5), 26 };
+    Rule rule5766 = { countRange(5, 7), countRange(6, 6), 26 };
+
+    if (rule == defaultRule()) {
+        return select.template pick<DefaultRule>();
+    }
+    if (rule == rule4555) {
+        return select.template pick<Rule4555>();
+    }
+    if (rule == rule5766) {
+        return select.template pick<Rule5766>();
+    }
+    return select.template pick<DynamicRule>();
+}
+
+// offsets of the cells in a neighborhood, returning how many there are
+inline int neighborOffsets(int neighborhood, int offsets[MAX_NEIGHBORS][3]) {
+    int maxDistance = neighborhood == 6 ? 1 : neighborhood == 18 ? 2 : 3;
+    int n = 0;
+    for (int dx = -1; dx <= 1; dx++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dz = -1; dz <= 1; dz++) {
+                int distance = (dx != 0) + (dy != 0) + (dz != 0);
+                if (distance > 0 && distance <= maxDistance) {
+                    offsets[n][0] = dx;
+                    offsets[n][1] = dy;
+                    offsets[n][2] = dz;
+                    n++;
+                }
+            }
+        }
+    }
+    return n;
+}
+
+// parses a comma separated list of counts and ranges, such as "2-4" or "4,5"
+inline bool parseCounts(const std::string &list, int maxCount, uint32_t &counts) {
+    std::stringstream in(list);
+    std::string item;
+    counts = 0;
+    while (std::getline(in, item, ',')) {
+        int first, last;
+        char dash;
+        std::stringstream range(item);
+        if (!(range >> first)) {
+            return false;
+        }
+        last = first;
+        if (range >> dash && !(dash == '-' && range >> last)) {
+            return false;
+        }
+        if (first < 0 || last > maxCount || first > last) {
+            return false;
+        }
+        counts |= countRange(first, last);
+    }
+    return true;
+}
+
+/*
+ * Parses "survive/birth/neighborhood", for example "2-4/2-3/6" for the
+ * built-in rule or "4,5/5/26". Births with no neighbors are refused, since
+ * the sparse engines never look at cells without live neighbors.
+ */
+inline bool parseRule(const std::string &spec, Rule &rule) {
+    size_t first = spec.find('/');
+    size_t second = first == std::string::npos ? first : spec.find('/', first + 1);
+    if (second == std::string::npos) {
+        return false;
+    }
+
+    std::stringstream neighborhood(spec.substr(second + 1));
+    if (!(neighborhood >> rule.neighborhood) ||
+        (rule.neighborhood != 6 && rule.neighborhood != 18 && rule.neighborhood != 26)) {
+        return false;
+    }
+
+    return parseCounts(spec.substr(0, first), rule.neighborhood, rule.survive) &&
+           parseCounts(spec.substr(first + 1, second - first - 1), rule.neighborhood, rule.birth) &&
+           !(rule.birth & 1);
+}
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef SHAREDCOUNTER_H
+#define SHAREDCOUNTER_H
+
+#include <atomic>
+#include <memory>
+#include "cellset.h"
+
+/*
+ * Open-addressing map from cell key to a neighbor count that many threads
+ * add to at once without locks: a thread claims an empty slot for a new
+ * key with a compare-and-swap and bumps counts with fetch_add. The
+ * capacity is fixed while threads add; a new key is refused once half the
+ * slots are claimed, so probes always end, and the caller keeps refused
+ * increments aside and hands them to increment() afterwards, which grows
+ * the table. Grown capacity is kept, so refusals stop once the table fits
+ * a generation. Everything but add() is for one thread at a time.
+ */
+class SharedCounter
+{
+public:
+
+    struct Slot {
+        std::atomic<CellKey> key;
+        std::atomic<int> count;
+    };
+
+private:
+
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    size_t limit; // claimed slots allowed, half the capacity
+    std::atomic<size_t> claimed;
+
+    void allocate(size_t capacity) {
+        slots.reset(new Slot[capacity]);
+        mask = capacity - 1;
+        limit = capacity / 2;
+        for (size_t i = 0; i < capacity; i++) {
+            slots[i].key.store(EMPTY_KEY, std::memory_order_relaxed);
+            slots[i].count.store(0, std::memory_order_relaxed);
+        }
+        claimed.store(0, std::memory_order_relaxed);
+    }
+
+    void rehash(size_t capacity) {
+        std::unique_ptr<Slot[]> old(slots.release());
+        size_t oldCapacity = mask + 1;
+        allocate(capacity);
+        for (size_t i = 0; i < oldCapacity; i++) {
+            CellKey key = old[i].key.load(std::memory_order_relaxed);
+            if (key != EMPTY_KEY) {
+                add(key, old[i].count.load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+public:
+
+    // yields each claimed slot as a CellCounter::Entry, read once the adding is over
+    class iterator
+    {
+    private:
+
+        const Slot *slot;
+        const Slot *last;
+        CellCounter::Entry entry;
+
+        void skipEmpty() {
+            while (slot != last && slot->key.load(std::memory_order_relaxed) == EMPTY_KEY) {
+                slot++;
+            }
+            if (slot != last) {
+                entry.key = slot->key.load(std::memory_order_relaxed);
+                entry.count = slot->count.load(std::memory_order_relaxed);
+            }
+        }
+
+    public:
+
+        iterator(const Slot *slot, const Slot *last) : slot(slot), last(last) {
+            skipEmpty();
+        }
+
+        inline const CellCounter::Entry &operator*() const {
+            return entry;
+        }
+
+        inline const CellCounter::Entry *operator->() const {
+            return &entry;
+        }
+
+        inline iterator &operator++() {
+            slot++;
+            skipEmpty();
+            return *this;
+        }
+
+        inline bool operator!=(const iterator &it) const {
+            return slot != it.slot;
+        }
+
+        inline bool operator==(const iterator &it) const {
+            return slot == it.slot;
+        }
+    };
+
+    SharedCounter() : mask(0), limit(0), claimed(0) {
+        allocate(MIN_CAPACITY);
+    }
+
+    // moves are only for sizing containers of tables, never while threads add
+    SharedCounter(SharedCounter &&other) noexcept : slots(std::move(other.slots)), mask(other.mask),
+                                                    limit(other.limit), claimed(other.claimed.load()) {
+        other.allocate(MIN_CAPACITY);
+    }
+
+    /*
+     * Adds amount to the count of key, claiming a slot if key is new.
+     * Safe to call from many threads at once. Returns false, changing
+     * nothing, when key is new and the table is at its limit.
+     */
+    inline bool add(CellKey key, int amount) {
+        size_t pos = mixKey(key) & mask;
+        bool reserved = false;
+        for (;;) {
+            Slot &slot = slots[pos];
+            CellKey seen = slot.key.load(std::memory_order_relaxed);
+            if (seen == EMPTY_KEY) {
+                // hold one of the limit claims before taking the slot
+                if (!reserved) {
+                    if (claimed.fetch_add(1, std::memory_order_relaxed) >= limit) {
+                        claimed.fetch_sub(1, std::memory_order_relaxed);
+                        return false;
+                    }
+                    reserved = true;
+                }
+                if (slot.key.compare_exchange_strong(seen, key, std::memory_order_relaxed)) {
+                    slot.count.fetch_add(amount, std::memory_order_relaxed);
+                    return true;
+                }
+                // another thread took the slot; seen is now its key
+            }
+            if (seen == key) {
+                if (reserved) {
+                    claimed.fetch_sub(1, std::memory_order_relaxed);
+                }
+                slot.count.fetch_add(amount, std::memory_order_relaxed);
+                return true;
+            }
+            pos = (pos + 1) & mask;
+        }
+    }
+
+    // add() for a single thread, growing the table instead of refusing
+    inline void increment(CellKey key, int amount) {
+        while (!add(key, amount)) {
+            rehash(2 * (mask + 1));
+        }
+    }
+
+    inline void reserve(size_t n) {
+        size_t capacity = tableCapacity(n);
+        if (capacity > mask + 1) {
+            rehash(capacity);
+        }
+    }
+
+    inline void clear() {
+        for (size_t i = 0; i <= mask; i++) {
+            slots[i].key.store(EMPTY_KEY, std::memory_order_relaxed);
+            slots[i].count.store(0, std::memory_order_relaxed);
+        }
+        claimed.store(0, std::memory_order_relaxed);
+    }
+
+    inline size_t size() const {
+        return claimed.load(std::memory_order_relaxed);
+    }
+
+    inline size_t capacity() const {
+        return mask + 1;
+    }
+
+    inline iterator begin() const {
+        return iterator(slots.get(), slots.get() + mask + 1);
+    }
+
+    inline iterator end() const {
+        const Slot *last = slots.get() + mask + 1;
+        return iterator(last, last);
+    }
+};
+
+#endif
@@ -0,0 +1,411 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include "cellset.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_X86
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512dq,popcnt")))
+#endif
+
+/*
+ * Vector kernels for the scatter kernel and the dense grid. Each one is
+ * compiled for AVX2 and for AVX-512 through target attributes, so no
+ * extra compiler flags are needed, and the widest one the CPU supports
+ * is picked at startup; the scalar versions are the fallback.
+ */
+
+enum SimdLevel { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+
+inline SimdLevel detectSimd() {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("popcnt")) {
+        return SIMD_SCALAR;
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+// level used by the kernels, the best supported one unless lowered
+inline SimdLevel &simdLevel() {
+    static SimdLevel level = detectSimd();
+    return level;
+}
+
+inline const char *simdName(SimdLevel level) {
+    return level == SIMD_AVX512 ? "avx512" : level == SIMD_AVX2 ? "avx2" : "scalar";
+}
+
+// lowers the level to the named one; levels above the CPU's are refused
+inline bool selectSimd(const std::string &name) {
+    SimdLevel supported = detectSimd();
+    for (int level = SIMD_SCALAR; level <= supported; level++) {
+        if (name == simdName((SimdLevel) level)) {
+            simdLevel() = (SimdLevel) level;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Neighbor keys: moving one step along a coordinate adds or subtracts its
+ * unit in the packed key, or wraps around by size - 1 units at the edge
+ * of the torus, so each neighbor is one compare, one select and one add.
+ * out[d * n + i] is the d-th neighbor of cells[i], in getNeighbors order.
+ */
+
+inline void batchNeighborKeysScalar(const CellKey *cells, size_t n, int size, CellKey *out, size_t i) {
+    for (; i < n; i++) {
+        CellKey key = cells[i];
+        for (int d = 0; d < 3; d++) {
+            int shift = (2 - d) * KEY_BITS;
+            CellKey unit = 1ULL << shift;
+            CellKey field = (key >> shift) & KEY_MASK;
+            CellKey span = (CellKey) (size - 1) << shift;
+            out[(2 * d) * n + i] = field == 0 ? key + span : key - unit;
+            out[(2 * d + 1) * n + i] = field == (CellKey) (size - 1) ? key - span : key + unit;
+        }
+    }
+}
+
+#ifdef SIMD_X86
+
+TARGET_AVX2 inline size_t batchNeighborKeysAvx2(const CellKey *cells, size_t n, int size, CellKey *out) {
+    const __m256i fieldMask = _mm256_set1_epi64x(KEY_MASK);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i last = _mm256_set1_epi64x(size - 1);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i key = _mm256_loadu_si256((const __m256i *) (cells + i));
+        for (int d = 0; d < 3; d++) {
+            int shift = (2 - d) * KEY_BITS;
+            __m256i unit = _mm256_set1_epi64x(1LL << shift);
+            __m256i span = _mm256_set1_epi64x((long long) (size - 1) << shift);
+            __m256i field = _mm256_and_si256(_mm256_srli_epi64(key, shift), fieldMask);
+            __m256i atFirst = _mm256_cmpeq_epi64(field, zero);
+            __m256i atLast = _mm256_cmpeq_epi64(field, last);
+            __m256i down = _mm256_blendv_epi8(_mm256_sub_epi64(key, unit), _mm256_add_epi64(key, span), atFirst);
+            __m256i up = _mm256_blendv_epi8(_mm256_add_epi64(key, unit), _mm256_sub_epi64(key, span), atLast);
+            _mm256_storeu_si256((__m256i *) (out + (2 * d) * n + i), down);
+            _mm256_storeu_si256((__m256i *) (out + (2 * d + 1) * n + i), up);
+        }
+    }
+    return i;
+}
+
+TARGET_AVX512 inline size_t batchNeighborKeysAvx512(const CellKey *cells, size_t n, int size, CellKey *out) {
+    const __m512i fieldMask = _mm512_set1_epi64(KEY_MASK);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i last = _mm512_set1_epi64(size - 1);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i key = _mm512_loadu_si512(cells + i);
+        for (int d = 0; d < 3; d++) {
+            int shift = (2 - d) * KEY_BITS;
+            __m512i unit = _mm512_set1_epi64(1LL << shift);
+            __m512i span = _mm512_set1_epi64((long long) (size - 1) << shift);
+            __m512i field = _mm512_and_si512(_mm512_srli_epi64(key, shift), fieldMask);
+            __mmask8 atFirst = _mm512_cmpeq_epi64_mask(field, zero);
+            __mmask8 atLast = _mm512_cmpeq_epi64_mask(field, last);
+            __m512i down = _mm512_mask_blend_epi64(atFirst, _mm512_sub_epi64(key, unit), _mm512_add_epi64(key, span));
+            __m512i up = _mm512_mask_blend_epi64(atLast, _mm512_add_epi64(key, unit), _mm512_sub_epi64(key, span));
+            _mm512_storeu_si512(out + (2 * d) * n + i, down);
+            _mm512_storeu_si512(out + (2 * d + 1) * n + i, up);
+        }
+    }
+    return i;
+}
+
+#endif
+
+inline void batchNeighborKeys(const CellKey *cells, size_t n, int size, CellKey *out) {
+    size_t done = 0;
+#ifdef SIMD_X86
+    if (simdLevel() == SIMD_AVX512) {
+        done = batchNeighborKeysAvx512(cells, n, size, out);
+    }
+    else if (simdLevel() == SIMD_AVX2) {
+        done = batchNeighborKeysAvx2(cells, n, size, out);
+    }
+#endif
+    batchNeighborKeysScalar(cells, n, size, out, done);
+}
+
+/*
+ * mixKey of n keys at once, so the hash tables can be probed with
+ * precomputed hashes. AVX2 has no 64-bit multiply and builds it from
+ * three 32-bit ones.
+ */
+
+#ifdef SIMD_X86
+
+TARGET_AVX2 inline __m256i multiplyAvx2(__m256i a, __m256i b) {
+    __m256i low = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                     _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+TARGET_AVX2 inline size_t mixKeysAvx2(const CellKey *keys, size_t n, uint64_t *hashes) {
+    const __m256i c1 = _mm256_set1_epi64x(0xff51afd7ed558ccdULL);
+    const __m256i c2 = _mm256_set1_epi64x(0xc4ceb9fe1a85ec53ULL);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i k = _mm256_loadu_si256((const __m256i *) (keys + i));
+        k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 33));
+        k = multiplyAvx2(k, c1);
+        k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 33));
+        k = multiplyAvx2(k, c2);
+        k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 33));
+        _mm256_storeu_si256((__m256i *) (hashes + i), k);
+    }
+    return i;
+}
+
+TARGET_AVX512 inline size_t mixKeysAvx512(const CellKey *keys, size_t n, uint64_t *hashes) {
+    const __m512i c1 = _mm512_set1_epi64(0xff51afd7ed558ccdULL);
+    const __m512i c2 = _mm512_set1_epi64(0xc4ceb9fe1a85ec53ULL);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i k = _mm512_loadu_si512(keys + i);
+        k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 33));
+        k = _mm512_mullo_epi64(k, c1);
+        k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 33));
+        k = _mm512_mullo_epi64(k, c2);
+        k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 33));
+        _mm512_storeu_si512(hashes + i, k);
+    }
+    return i;
+}
+
+#endif
+
+inline void mixKeys(const CellKey *keys, size_t n, uint64_t *hashes) {
+    size_t i = 0;
+#ifdef SIMD_X86
+    if (simdLevel() == SIMD_AVX512) {
+        i = mixKeysAvx512(keys, n, hashes);
+    }
+    else if (simdLevel() == SIMD_AVX2) {
+        i = mixKeysAvx2(keys, n, hashes);
+    }
+#endif
+    for (; i < n; i++) {
+        hashes[i] = mixKey(keys[i]);
+    }
+}
+
+/*
+ * Rule sweep over the slots of a scatter count table: appends to out the
+ * keys whose count (neighbors + LIVE_MARK if alive) gives a live cell,
+ * and returns how many. Counts are gathered 8 or 16 slots at a time and
+ * the rule is evaluated as vector compares; empty slots count 0 and
+ * never qualify.
+ */
+
+inline bool scatterRule(int count) {
+    int neighbors = count % LIVE_MARK;
+    return neighbors == 2 || neighbors == 3 || (count >= LIVE_MARK && neighbors == 4);
+}
+
+#ifdef SIMD_X86
+
+TARGET_AVX2 inline size_t selectAliveAvx2(const CellCounter::Entry *slots, size_t n, CellKey *out, size_t &i) {
+    const int stride = sizeof(CellCounter::Entry) / sizeof(int);
+    const int *counts = (const int *) slots + offsetof(CellCounter::Entry, count) / sizeof(int);
+    const __m256i index = _mm256_setr_epi32(0, stride, 2 * stride, 3 * stride, 4 * stride, 5 * stride, 6 * stride, 7 * stride);
+    const __m256i neighborMask = _mm256_set1_epi32(LIVE_MARK - 1);
+    const __m256i aliveBelow = _mm256_set1_epi32(LIVE_MARK - 1);
+    const __m256i two = _mm256_set1_epi32(2), three = _mm256_set1_epi32(3), four = _mm256_set1_epi32(4);
+    size_t m = 0;
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i count = _mm256_i32gather_epi32(counts + i * stride, index, 4);
+        __m256i neighbors = _mm256_and_si256(count, neighborMask);
+        __m256i alive = _mm256_cmpgt_epi32(count, aliveBelow);
+        __m256i next = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi32(neighbors, two), _mm256_cmpeq_epi32(neighbors, three)),
+                                       _mm256_and_si256(alive, _mm256_cmpeq_epi32(neighbors, four)));
+        unsigned bits = _mm256_movemask_ps(_mm256_castsi256_ps(next));
+        while (bits) {
+            out[m++] = slots[i + __builtin_ctz(bits)].key;
+            bits &= bits - 1;
+        }
+    }
+    return m;
+}
+
+TARGET_AVX512 inline size_t selectAliveAvx512(const CellCounter::Entry *slots, size_t n, CellKey *out, size_t &i) {
+    const int stride = sizeof(CellCounter::Entry) / sizeof(int);
+    const int *counts = (const int *) slots + offsetof(CellCounter::Entry, count) / sizeof(int);
+    const __m512i index = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                             _mm512_set1_epi32(stride));
+    const __m512i neighborMask = _mm512_set1_epi32(LIVE_MARK - 1);
+    const __m512i liveMark = _mm512_set1_epi32(LIVE_MARK);
+    const __m512i two = _mm512_set1_epi32(2), three = _mm512_set1_epi32(3), four = _mm512_set1_epi32(4);
+    size_t m = 0;
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m512i count = _mm512_i32gather_epi32(index, counts + i * stride, 4);
+        __m512i neighbors = _mm512_and_si512(count, neighborMask);
+        __mmask16 alive = _mm512_cmpge_epi32_mask(count, liveMark);
+        __mmask16 next = _mm512_cmpeq_epi32_mask(neighbors, two) | _mm512_cmpeq_epi32_mask(neighbors, three) |
+                         (alive & _mm512_cmpeq_epi32_mask(neighbors, four));
+        unsigned bits = next;
+        while (bits) {
+            out[m++] = slots[i + __builtin_ctz(bits)].key;
+            bits &= bits - 1;
+        }
+    }
+    return m;
+}
+
+#endif
+
+inline size_t selectAlive(const CellCounter::Entry *slots, size_t n, CellKey *out) {
+    size_t i = 0, m = 0;
+#ifdef SIMD_X86
+    if (simdLevel() == SIMD_AVX512) {
+        m = selectAliveAvx512(slots, n, out, i);
+    }
+    else if (simdLevel() == SIMD_AVX2) {
+        m = selectAliveAvx2(slots, n, out, i);
+    }
+#endif
+    for (; i < n; i++) {
+        if (scatterRule(slots[i].count)) {
+            out[m++] = slots[i].key;
+        }
+    }
+    return m;
+}
+
+/*
+ * Dense rule over words [begin, end) of a BitGrid row, whose x neighbors
+ * are all inside the row: unaligned loads one word back and one word
+ * ahead supply the bits carried across words. Returns the first word not
+ * done, which the caller finishes with the scalar ruleWord.
+ */
+
+#ifdef SIMD_X86
+
+TARGET_AVX2 inline void fullAdderAvx2(__m256i a, __m256i b, __m256i c, __m256i &sum, __m256i &carry) {
+    __m256i t = _mm256_xor_si256(a, b);
+    sum = _mm256_xor_si256(t, c);
+    carry = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(t, c));
+}
+
+TARGET_AVX2 inline int evolveWordsAvx2(const uint64_t *row, const uint64_t *yDown, const uint64_t *yUp,
+                                       const uint64_t *zDown, const uint64_t *zUp, uint64_t *out, int begin, int end) {
+    int w = begin;
+    for (; w + 4 <= end; w += 4) {
+        __m256i cell = _mm256_loadu_si256((const __m256i *) (row + w));
+        __m256i before = _mm256_loadu_si256((const __m256i *) (row + w - 1));
+        __m256i after = _mm256_loadu_si256((const __m256i *) (row + w + 1));
+        __m256i xd = _mm256_or_si256(_mm256_slli_epi64(cell, 1), _mm256_srli_epi64(before, 63));
+        __m256i xu = _mm256_or_si256(_mm256_srli_epi64(cell, 1), _mm256_slli_epi64(after, 63));
+
+        __m256i sumA, carryA, sumB, carryB, s1, s2;
+        fullAdderAvx2(xd, xu, _mm256_loadu_si256((const __m256i *) (yDown + w)), sumA, carryA);
+        fullAdderAvx2(_mm256_loadu_si256((const __m256i *) (yUp + w)),
+                      _mm256_loadu_si256((const __m256i *) (zDown + w)),
+                      _mm256_loadu_si256((const __m256i *) (zUp + w)), sumB, carryB);
+        __m256i s0 = _mm256_xor_si256(sumA, sumB);
+        fullAdderAvx2(carryA, carryB, _mm256_and_si256(sumA, sumB), s1, s2);
+
+        // ~s2 & s1 | cell & s2 & ~s1 & ~s0
+        __m256i twoOrThree = _mm256_andnot_si256(s2, s1);
+        __m256i four = _mm256_andnot_si256(_mm256_or_si256(s1, s0), s2);
+        _mm256_storeu_si256((__m256i *) (out + w), _mm256_or_si256(twoOrThree, _mm256_and_si256(cell, four)));
+    }
+    return w;
+}
+
+TARGET_AVX512 inline int evolveWordsAvx512(const uint64_t *row, const uint64_t *yDown, const uint64_t *yUp,
+                                           const uint64_t *zDown, const uint64_t *zUp, uint64_t *out, int begin, int end) {
+    for (int w = begin; w < end; w += 8) {
+        // masked loads and stores cover the tail, masked-out words are never touched
+        __mmask8 m = end - w >= 8 ? 0xff : (__mmask8) ((1u << (end - w)) - 1);
+        __m512i cell = _mm512_maskz_loadu_epi64(m, row + w);
+        __m512i before = _mm512_maskz_loadu_epi64(m, row + w - 1);
+        __m512i after = _mm512_maskz_loadu_epi64(m, row + w + 1);
+        __m512i xd = _mm512_or_si512(_mm512_slli_epi64(cell, 1), _mm512_srli_epi64(before, 63));
+        __m512i xu = _mm512_or_si512(_mm512_srli_epi64(cell, 1), _mm512_slli_epi64(after, 63));
+        __m512i yd = _mm512_maskz_loadu_epi64(m, yDown + w);
+        __m512i yu = _mm512_maskz_loadu_epi64(m, yUp + w);
+        __m512i zd = _mm512_maskz_loadu_epi64(m, zDown + w);
+        __m512i zu = _mm512_maskz_loadu_epi64(m, zUp + w);
+
+        // full adders as three-input logic: 0x96 is a ^ b ^ c, 0xe8 the majority
+        __m512i sumA = _mm512_ternarylogic_epi64(xd, xu, yd, 0x96);
+        __m512i carryA = _mm512_ternarylogic_epi64(xd, xu, yd, 0xe8);
+        __m512i sumB = _mm512_ternarylogic_epi64(yu, zd, zu, 0x96);
+        __m512i carryB = _mm512_ternarylogic_epi64(yu, zd, zu, 0xe8);
+        __m512i s0 = _mm512_xor_si512(sumA, sumB);
+        __m512i carry0 = _mm512_and_si512(sumA, sumB);
+        __m512i s1 = _mm512_ternarylogic_epi64(carryA, carryB, carry0, 0x96);
+        __m512i s2 = _mm512_ternarylogic_epi64(carryA, carryB, carry0, 0xe8);
+
+        __m512i twoOrThree = _mm512_andnot_si512(s2, s1);
+        __m512i four = _mm512_andnot_si512(_mm512_or_si512(s1, s0), s2);
+        _mm512_mask_storeu_epi64(out + w, m, _mm512_or_si512(twoOrThree, _mm512_and_si512(cell, four)));
+    }
+    return end > begin ? end : begin;
+}
+
+#endif
+
+inline int evolveWords(const uint64_t *row, const uint64_t *yDown, const uint64_t *yUp,
+                       const uint64_t *zDown, const uint64_t *zUp, uint64_t *out, int begin, int end) {
+#ifdef SIMD_X86
+    if (simdLevel() == SIMD_AVX512) {
+        return evolveWordsAvx512(row, yDown, yUp, zDown, zUp, out, begin, end);
+    }
+    if (simdLevel() == SIMD_AVX2) {
+        return evolveWordsAvx2(row, yDown, yUp, zDown, zUp, out, begin, end);
+    }
+#endif
+    return begin;
+}
+
+/*
+ * Live cells in n words. Without a target the compiler calls a table
+ * based popcount; both vector levels imply the popcnt instruction.
+ */
+
+#ifdef SIMD_X86
+
+TARGET_AVX2 inline size_t countWordsPopcnt(const uint64_t *words, int n) {
+    size_t count = 0;
+    for (int w = 0; w < n; w++) {
+        count += __builtin_popcountll(words[w]);
+    }
+    return count;
+}
+
+#endif
+
+inline size_t countWords(const uint64_t *words, int n) {
+#ifdef SIMD_X86
+    if (simdLevel() != SIMD_SCALAR) {
+        return countWordsPopcnt(words, n);
+    }
+#endif
+    size_t count = 0;
+    for (int w = 0; w < n; w++) {
+        count += __builtin_popcountll(words[w]);
+    }
+    return count;
+}
+
+#endif
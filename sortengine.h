@@ -0,0 +1,243 @@
+#ifndef SORTENGINE_H
+#define SORTENGINE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include "cellset.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define RADIX_BITS 11
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+/*
+ * Engine without hash tables: a generation is a sorted vector of compact
+ * keys, x, y and z packed with just enough bits for the world size, so
+ * the order is the (x, y, z) order printResults needs.
+ *
+ * Every generation the six neighbor keys of each live cell go into a flat
+ * buffer that is radix sorted; the length of each run of equal keys is the
+ * neighbor count of that cell, and merging the runs against the live list
+ * applies the rule. All passes stream through memory and split evenly
+ * among OpenMP threads when built with -fopenmp.
+ */
+class SortEngine
+{
+private:
+
+    int size;
+    int bits; // bits per coordinate
+    uint64_t mask;
+    std::vector<uint64_t> live;
+    std::vector<uint64_t> neighbors;
+    std::vector<uint64_t> buffer;
+    std::vector<std::vector<uint64_t> > threadOutput;
+
+    inline uint64_t pack(uint64_t x, uint64_t y, uint64_t z) const {
+        return (x << (2 * bits)) | (y << bits) | z;
+    }
+
+    static inline int nrThreads() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    static inline int threadId() {
+#ifdef _OPENMP
+        return omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
+
+    // first element of the i-th of n equal parts of a range of length count
+    static inline size_t split(size_t count, int i, int n) {
+        return count * i / n;
+    }
+
+    void emitNeighbors() {
+        size_t count = live.size();
+        neighbors.resize(6 * count);
+        uint64_t last = size - 1;
+
+        #pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < count; i++) {
+            uint64_t key = live[i];
+            uint64_t x = key >> (2 * bits);
+            uint64_t y = (key >> bits) & mask;
+            uint64_t z = key & mask;
+            uint64_t *out = &neighbors[6 * i];
+
+            out[0] = pack(x == 0 ? last : x - 1, y, z);
+            out[1] = pack(x == last ? 0 : x + 1, y, z);
+            out[2] = pack(x, y == 0 ? last : y - 1, z);
+            out[3] = pack(x, y == last ? 0 : y + 1, z);
+            out[4] = pack(x, y, z == 0 ? last : z - 1);
+            out[5] = pack(x, y, z == last ? 0 : z + 1);
+        }
+    }
+
+    /*
+     * LSD radix sort of the neighbor buffer, RADIX_BITS per pass over the
+     * 3 * bits used bits. Each thread histograms and then scatters its own
+     * contiguous chunk, which keeps every pass stable.
+     */
+    void sortNeighbors() {
+        size_t count = neighbors.size();
+        int keyBits = 3 * bits;
+        int nrPasses = (keyBits + RADIX_BITS - 1) / RADIX_BITS;
+        int threads = nrThreads();
+        std::vector<size_t> offsets((size_t) threads * RADIX_BUCKETS);
+        buffer.resize(count);
+
+        for (int pass = 0; pass < nrPasses; pass++) {
+            int shift = pass * RADIX_BITS;
+
+            #pragma omp parallel num_threads(threads)
+            {
+                int t = threadId();
+                size_t begin = split(count, t, threads);
+                size_t end = split(count, t + 1, threads);
+                size_t *histogram = &offsets[(size_t) t * RADIX_BUCKETS];
+                std::fill(histogram, histogram + RADIX_BUCKETS, 0);
+
+                for (size_t i = begin; i < end; i++) {
+                    histogram[(neighbors[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+                }
+
+                #pragma omp barrier
+                #pragma omp single
+                {
+                    // bucket-major, thread-minor prefix sum
+                    size_t sum = 0;
+                    for (int b = 0; b < RADIX_BUCKETS; b++) {
+                        for (int u = 0; u < threads; u++) {
+                            size_t n = offsets[(size_t) u * RADIX_BUCKETS + b];
+                            offsets[(size_t) u * RADIX_BUCKETS + b] = sum;
+                            sum += n;
+                        }
+                    }
+                }
+
+                for (size_t i = begin; i < end; i++) {
+                    uint64_t key = neighbors[i];
+                    buffer[histogram[(key >> shift) & (RADIX_BUCKETS - 1)]++] = key;
+                }
+            }
+
+            neighbors.swap(buffer);
+        }
+    }
+
+    /*
+     * Walks the runs of equal keys of the sorted neighbor buffer alongside
+     * the live list. A live cell survives with 2 to 4 neighbors, a dead one
+     * is born with 2 or 3; cells with no live neighbors never show up in
+     * the buffer and so die or stay dead.
+     */
+    void applyRule() {
+        size_t count = neighbors.size();
+        int threads = nrThreads();
+        threadOutput.resize(threads);
+
+        #pragma omp parallel num_threads(threads)
+        {
+            int t = threadId();
+            size_t begin = split(count, t, threads);
+            size_t end = split(count, t + 1, threads);
+
+            // move both ends forward to the start of a run
+            while (begin > 0 && begin < count && neighbors[begin] == neighbors[begin - 1]) {
+                begin++;
+            }
+            while (end > 0 && end < count && neighbors[end] == neighbors[end - 1]) {
+                end++;
+            }
+
+            std::vector<uint64_t> &out = threadOutput[t];
+            out.clear();
+            std::vector<uint64_t>::const_iterator alive = live.begin();
+            if (begin < end) {
+                alive = std::lower_bound(live.begin(), live.end(), neighbors[begin]);
+            }
+
+            size_t i = begin;
+            while (i < end) {
+                uint64_t key = neighbors[i];
+                size_t j = i + 1;
+                while (j < end && neighbors[j] == key) {
+                    j++;
+                }
+                size_t nrNeighbors = j - i;
+
+                while (alive != live.end() && *alive < key) {
+                    ++alive;
+                }
+                bool isAlive = alive != live.end() && *alive == key;
+
+                if (nrNeighbors == 2 || nrNeighbors == 3 || (isAlive && nrNeighbors == 4)) {
+                    out.push_back(key);
+                }
+                i = j;
+            }
+        }
+
+        size_t total = 0;
+        for (int t = 0; t < threads; t++) {
+            total += threadOutput[t].size();
+        }
+        live.resize(total);
+
+        size_t offset = 0;
+        for (int t = 0; t < threads; t++) {
+            std::copy(threadOutput[t].begin(), threadOutput[t].end(), live.begin() + offset);
+            offset += threadOutput[t].size();
+        }
+    }
+
+public:
+
+    SortEngine(int size) : size(size), bits(1) {
+        while ((1 << bits) < size) {
+            bits++;
+        }
+        mask = (1ULL << bits) - 1;
+    }
+
+    inline size_t population() const {
+        return live.size();
+    }
+
+    void load(const std::vector<CellKey> &cells) {
+        live.clear();
+        live.reserve(cells.size());
+        for (auto it = cells.begin(); it != cells.end(); ++it) {
+            live.push_back(pack(cellX(*it), cellY(*it), cellZ(*it)));
+        }
+        std::sort(live.begin(), live.end());
+    }
+
+    void evolve() {
+        emitNeighbors();
+        sortNeighbors();
+        applyRule();
+    }
+
+    // live cells as CellKeys, already in print order
+    void cells(std::vector<CellKey> &keys) const {
+        keys.reserve(keys.size() + live.size());
+        for (size_t i = 0; i < live.size(); i++) {
+            uint64_t key = live[i];
+            keys.push_back(packCell((int) (key >> (2 * bits)), (int) ((key >> bits) & mask), (int) (key & mask)));
+        }
+    }
+};
+
+#endif
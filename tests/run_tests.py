@@ -27,11 +27,15 @@ files = []
 for file in dir_files:
     files += [str.split(file, '.')]
 
+# options after the version flag are passed on to the binary,
+# e.g. python3 run_tests.py -serial -engine dense
+options = sys.argv[2:]
+
 def run_tests(exec_name):
     for file in files:
         name = file[0] + '.' + file[1]
         with open(name + '.myout', 'w') as outfile:
-            run_command = ([exec_name, file[0] + '.in', file[1]]);
+            run_command = ([exec_name, file[0] + '.in', file[1]] + options);
             print(BOLD + ' '.join(run_command) + RESET)
             start = time.time() 
             subprocess.run(run_command, stdout=outfile)
@@ -45,9 +49,9 @@ def run_tests(exec_name):
             #else:
             #    print(RED + "Test failed" + RESET + "\n")
 
-if len(sys.argv) != 2:
+if len(sys.argv) < 2:
     print("Usage:")
-    print("To run serial version: python3 run_tests.py -serial")
+    print("To run serial version: python3 run_tests.py -serial [options]")
     print("To run OpenMP version: python3 run_tests.py -openmp")
     print("To run MPI version: python3 run_tests.py -mpi")
 
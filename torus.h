@@ -0,0 +1,65 @@
+#ifndef TORUS_H
+#define TORUS_H
+
+/*
+ * Wraparound of a coordinate on the size^3 torus. The evolve kernels are
+ * templates on one of these classes: every power of two size gets its own
+ * instantiation, where wrapping is an and with a compile-time mask, and
+ * all other sizes share the compare-and-branch version.
+ */
+
+struct GenericTorus {
+    int size;
+
+    explicit GenericTorus(int size) : size(size) {
+
+    }
+
+    inline int down(int c) const {
+        return c - 1 < 0 ? size - 1 : c - 1;
+    }
+
+    inline int up(int c) const {
+        return c + 1 >= size ? 0 : c + 1;
+    }
+};
+
+template <int BITS>
+struct PowerOfTwoTorus {
+    enum { SIZE = 1 << BITS, MASK = SIZE - 1 };
+
+    explicit PowerOfTwoTorus(int) {
+
+    }
+
+    inline int down(int c) const {
+        return (c - 1) & MASK;
+    }
+
+    inline int up(int c) const {
+        return (c + 1) & MASK;
+    }
+};
+
+/*
+ * Returns select.pick<Torus>() for the torus class of size, which is how
+ * main() turns the size read from the input into a specialized kernel.
+ */
+template <class Select>
+typename Select::Result selectTorus(int size, const Select &select) {
+    switch (size) {
+        case 1 << 2:  return select.template pick<PowerOfTwoTorus<2> >();
+        case 1 << 3:  return select.template pick<PowerOfTwoTorus<3> >();
+        case 1 << 4:  return select.template pick<PowerOfTwoTorus<4> >();
+        case 1 << 5:  return select.template pick<PowerOfTwoTorus<5> >();
+        case 1 << 6:  return select.template pick<PowerOfTwoTorus<6> >();
+        case 1 << 7:  return select.template pick<PowerOfTwoTorus<7> >();
+        case 1 << 8:  return select.template pick<PowerOfTwoTorus<8> >();
+        case 1 << 9:  return select.template pick<PowerOfTwoTorus<9> >();
+        case 1 << 10: return select.template pick<PowerOfTwoTorus<10> >();
+        case 1 << 11: return select.template pick<PowerOfTwoTorus<11> >();
+        default:      return select.template pick<GenericTorus>();
+    }
+}
+
+#endif